@@ -47,7 +47,7 @@ void show_code(struct litevm_vcpu *vcpu)
 	char buf[30 + 3 * sizeof code];
 	int i;
 
-	if (!is_long_mode())
+	if (!is_long_mode(vcpu))
 		rip += vmcs_readl(GUEST_CS_BASE);
 
 	litevm_read_guest(vcpu, rip, sizeof code, code);
@@ -71,10 +71,10 @@ void show_irq(struct litevm_vcpu *vcpu,  int irq)
 	unsigned long idt_limit = vmcs_readl(GUEST_IDTR_LIMIT);
 	struct gate_struct gate;
 
-	if (!is_long_mode())
+	if (!is_long_mode(vcpu))
 		vcpu_printf(vcpu, "%s: not in long mode\n", __FUNCTION__);
 
-	if (!is_long_mode() || idt_limit < irq * sizeof(gate)) {
+	if (!is_long_mode(vcpu) || idt_limit < irq * sizeof(gate)) {
 		vcpu_printf(vcpu, "%s: 0x%x read_guest err\n",
 			   __FUNCTION__,
 			   irq);
@@ -235,7 +235,7 @@ int vm_entry_test_guest(struct litevm_vcpu *vcpu)
 		return 0;
 	}
 
-	long_mode = is_long_mode();
+	long_mode = is_long_mode(vcpu);
 
 	if (long_mode) {
 	}
@@ -1015,10 +1015,10 @@ void regs_dump(struct litevm_vcpu *vcpu)
 void sregs_dump(struct litevm_vcpu *vcpu)
 {
 	vcpu_printf(vcpu, "************************ sregs_dump ************************\n");
-	vcpu_printf(vcpu, "cr0 = 0x%lx\n", guest_cr0());
+	vcpu_printf(vcpu, "cr0 = 0x%lx\n", guest_cr0(vcpu));
 	vcpu_printf(vcpu, "cr2 = 0x%lx\n", vcpu->cr2);
 	vcpu_printf(vcpu, "cr3 = 0x%lx\n", vcpu->cr3);
-	vcpu_printf(vcpu, "cr4 = 0x%lx\n", guest_cr4());
+	vcpu_printf(vcpu, "cr4 = 0x%lx\n", guest_cr4(vcpu));
 	vcpu_printf(vcpu, "cr8 = 0x%lx\n", vcpu->cr8);
 	vcpu_printf(vcpu, "shadow_efer = 0x%llx\n", vcpu->shadow_efer);
 	vmcs_dump(vcpu);
@@ -27,9 +27,15 @@ enum litevm_exit_reason {
 	LITEVM_EXIT_DEBUG,
 	LITEVM_EXIT_HLT,
 	LITEVM_EXIT_MMIO,
+	LITEVM_EXIT_MSR,
+	LITEVM_EXIT_BUDGET,
 };
 
-/* for LITEVM_RUN */
+/*
+ * for LITEVM_RUN, and shared with the kernel for LITEVM_RUN_VCPU: each vcpu
+ * has one of these in a page that userspace maps from the litevm fd at
+ * LITEVM_RUN_PAGE_OFFSET(vcpu).  The vcpu field is ignored in that case.
+ */
 struct litevm_run {
 	/* in */
 	__u32 vcpu;
@@ -76,6 +82,17 @@ struct litevm_run {
 			__u32 len;
 			__u8  is_write;
 		} mmio;
+		/*
+		 * LITEVM_EXIT_MSR: the instruction completes on the next run,
+		 * reading data (rdmsr), or raising #GP if error is set.
+		 */
+		struct {
+			__u32 index;
+			__u8  is_write;
+			__u8  error;
+			__u8  pad[2];
+			__u64 data;
+		} msr;
 	};
 };
 
@@ -174,6 +191,183 @@ struct litevm_dirty_log {
 	};
 };
 
+/*
+ * for LITEVM_SET_CYCLE_BUDGET: tsc cycles each LITEVM_RUN of the vcpu may
+ * run the guest before LITEVM_EXIT_BUDGET; 0 for no limit.  Needs the
+ * vmx preemption timer.
+ */
+struct litevm_cycle_budget {
+	__u32 vcpu;
+	__u32 padding;
+	__u64 cycles;
+};
+
+/* for LITEVM_SET_MSR_POLICY */
+struct litevm_msr_policy {
+	__u32 index;
+	__u32 policy;
+};
+
+/* for litevm_msr_policy::policy */
+#define LITEVM_MSR_INTERCEPT    0 /* handled by the kernel */
+#define LITEVM_MSR_PASSTHROUGH  1 /* no exit; only msrs the cpu switches */
+#define LITEVM_MSR_USERSPACE    2 /* LITEVM_EXIT_MSR */
+
+/* for LITEVM_SET_IO_POLICY */
+struct litevm_io_policy {
+	__u32 port;
+	__u32 count;	/* ports port .. port + count - 1 */
+	__u32 policy;
+	__u32 padding;
+};
+
+/* for litevm_io_policy::policy */
+#define LITEVM_IO_FORWARD       0 /* LITEVM_EXIT_IO */
+#define LITEVM_IO_IGNORE        1 /* writes dropped, reads return all ones */
+#define LITEVM_IO_PASSTHROUGH   2 /* no exit, host port; CAP_SYS_RAWIO */
+
+/*
+ * Statistics for a vm, with no text to parse: map one page read-only
+ * from the litevm fd at LITEVM_STATS_PAGE_OFFSET, or read() it whole
+ * from debugfs, litevm/<vm>/stats_page.  The vcpus update the counters
+ * in place; a reader adds up each counter across the vcpu blocks, or
+ * takes the largest if the descriptor says LITEVM_STAT_MAX.
+ */
+#define LITEVM_STATS_MAGIC      0x5453564cU /* "LVST" */
+#define LITEVM_STATS_VERSION    1
+
+struct litevm_stats_header {
+	__u32 magic;
+	__u32 version;
+	__u32 size;		/* of the whole thing, in bytes */
+	__u32 ndesc;
+	__u32 desc_offset;	/* ndesc struct litevm_stat_desc */
+	__u32 data_offset;	/* nvcpus blocks of __u64 counters */
+	__u32 vcpu_stride;	/* bytes from one vcpu block to the next */
+	__u32 nvcpus;
+};
+
+#define LITEVM_STAT_NAME_SIZE   24
+#define LITEVM_STAT_MAX         1 /* combine vcpus by max, not sum */
+
+struct litevm_stat_desc {
+	char  name[LITEVM_STAT_NAME_SIZE];
+	__u32 offset;		/* of the __u64, within a vcpu block */
+	__u32 flags;
+};
+
+/*
+ * A ring of records the kernel produces and userspace consumes through
+ * mmap, with no syscalls.  The kernel writes the record at head, then
+ * advances head; userspace reads from tail and advances tail.  Both wrap
+ * at size.  The ring is full when advancing head would make it equal
+ * tail, and records that don't fit are counted in lost.  Records start
+ * data_offset bytes from the header, LITEVM_RING_PAGES pages in all.
+ */
+#define LITEVM_RING_PAGES 4
+
+struct litevm_ring_header {
+	__u32 head;		/* written by the kernel */
+	__u32 tail;		/* written by userspace */
+	__u32 size;		/* in records */
+	__u32 record_size;
+	__u32 data_offset;
+	__u32 padding;
+	__u64 lost;
+};
+
+/* for LITEVM_SET_SAMPLING */
+struct litevm_sampling {
+	__u32 vcpu;
+	__u32 period_us;	/* 0 to stop */
+};
+
+/*
+ * Guest rip samples, one every period_us of guest time, in a ring at
+ * LITEVM_SAMPLE_RING_OFFSET(vcpu).
+ */
+struct litevm_rip_sample {
+	__u64 tsc;
+	__u64 rip;
+	__u64 cr3;
+	__u16 cs;
+	__u8  cpl;
+	__u8  padding;
+	__u32 exit_reason;	/* vmx exit the sample was taken at */
+};
+
+/*
+ * Every vmx exit, always, in a ring at LITEVM_EXIT_RING_OFFSET(vcpu).
+ * Exits userspace doesn't drain fast enough are counted in lost.
+ */
+struct litevm_exit_record {
+	__u64 tsc;		/* at the start of the handler */
+	__u64 rip;		/* at the exit */
+	__u64 qualification;
+	__u32 exit_reason;
+	__u32 cycles;		/* spent in the handler */
+};
+
+/*
+ * Record and replay of the exits userspace handles.  Recording puts a
+ * record in a ring at LITEVM_REPLAY_RING_OFFSET(vcpu) for each such exit
+ * once userspace has completed it, and one for each LITEVM_INTERRUPT.
+ * Replay completes the same exits from the records without leaving the
+ * kernel, until an exit doesn't match its record or the records run out;
+ * that exit goes to userspace as usual and replay is over.
+ */
+#define LITEVM_REPLAY_OFF    0
+#define LITEVM_REPLAY_RECORD 1
+#define LITEVM_REPLAY_PLAY   2
+
+/* for LITEVM_SET_REPLAY */
+struct litevm_replay {
+	__u32 vcpu;
+	__u32 mode;
+	__u64 records;		/* LITEVM_REPLAY_PLAY: user address */
+	__u32 nrecords;
+	__u32 padding;
+};
+
+#define LITEVM_REPLAY_EMULATED       (1 << 0)
+#define LITEVM_REPLAY_MMIO_COMPLETED (1 << 1)	/* data is the mmio data */
+#define LITEVM_REPLAY_IO_IN          (1 << 2)	/* data is the new rax */
+#define LITEVM_REPLAY_STRING         (1 << 3)	/* goes to userspace anyway */
+#define LITEVM_REPLAY_MSR_ERROR      (1 << 4)
+#define LITEVM_REPLAY_IRQ            (1 << 5)	/* key is the irq */
+
+struct litevm_replay_record {
+	__u64 rip;		/* at the exit, or when the irq was raised */
+	__u64 key;		/* port, mmio address, msr or irq */
+	__u64 data;		/* rax, mmio data or msr data */
+	__u32 exit_reason;
+	__u32 flags;
+};
+
+#define LITEVM_REPLAY_RING_PGOFF     0xffb00000UL
+#define LITEVM_REPLAY_RING_OFFSET(vcpu) \
+	((__u64)(LITEVM_REPLAY_RING_PGOFF + (vcpu) * LITEVM_RING_PAGES) << 12)
+
+#define LITEVM_EXIT_RING_PGOFF       0xffc00000UL
+#define LITEVM_EXIT_RING_OFFSET(vcpu) \
+	((__u64)(LITEVM_EXIT_RING_PGOFF + (vcpu) * LITEVM_RING_PAGES) << 12)
+
+#define LITEVM_SAMPLE_RING_PGOFF     0xffd00000UL
+#define LITEVM_SAMPLE_RING_OFFSET(vcpu) \
+	((__u64)(LITEVM_SAMPLE_RING_PGOFF + (vcpu) * LITEVM_RING_PAGES) << 12)
+
+#define LITEVM_STATS_PAGE_PGOFF      0xffe00000UL
+#define LITEVM_STATS_PAGE_OFFSET     ((__u64)LITEVM_STATS_PAGE_PGOFF << 12)
+
+/*
+ * mmap() offset of a vcpu's struct litevm_run page.  It lies far above any
+ * guest physical address, so memory regions may not extend up to it.
+ * Needs a 64-bit off_t (mmap64) on 32-bit userspace.
+ */
+#define LITEVM_RUN_PAGE_PGOFF        0xfff00000UL
+#define LITEVM_RUN_PAGE_OFFSET(vcpu) \
+	((__u64)(LITEVM_RUN_PAGE_PGOFF + (vcpu)) << 12)
+
 #define LITEVMIO 0xAE
 
 #define LITEVM_RUN                   _IOWR(LITEVMIO, 2, struct litevm_run)
@@ -187,5 +381,11 @@ struct litevm_dirty_log {
 #define LITEVM_SET_MEMORY_REGION     _IOW(LITEVMIO, 10, struct litevm_memory_region)
 #define LITEVM_CREATE_VCPU           _IOW(LITEVMIO, 11, int /* vcpu_slot */)
 #define LITEVM_GET_DIRTY_LOG         _IOW(LITEVMIO, 12, struct litevm_dirty_log)
+#define LITEVM_RUN_VCPU              _IO(LITEVMIO, 13) /* arg: vcpu_slot */
+#define LITEVM_SET_MSR_POLICY        _IOW(LITEVMIO, 14, struct litevm_msr_policy)
+#define LITEVM_SET_IO_POLICY         _IOW(LITEVMIO, 15, struct litevm_io_policy)
+#define LITEVM_SET_SAMPLING          _IOW(LITEVMIO, 16, struct litevm_sampling)
+#define LITEVM_SET_REPLAY            _IOW(LITEVMIO, 17, struct litevm_replay)
+#define LITEVM_SET_CYCLE_BUDGET      _IOW(LITEVMIO, 18, struct litevm_cycle_budget)
 
 #endif
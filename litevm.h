@@ -6,6 +6,11 @@
 #include <linux/mutex.h>
 #include <linux/spinlock.h>
 #include <linux/mm.h>
+#include <linux/preempt.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/litevm.h>
 
 #include "vmx.h"
 
@@ -31,13 +36,17 @@
 #define CR4_VMXE_MASK (1ULL << 13)
 
 #define LITEVM_GUEST_CR0_MASK \
+	(CR0_PG_MASK | CR0_PE_MASK | CR0_WP_MASK | CR0_NE_MASK \
+	 | CR0_TS_MASK)
+#define LITEVM_VM_CR0_ALWAYS_ON \
 	(CR0_PG_MASK | CR0_PE_MASK | CR0_WP_MASK | CR0_NE_MASK)
-#define LITEVM_VM_CR0_ALWAYS_ON LITEVM_GUEST_CR0_MASK
+#define LITEVM_EPT_CR0_ALWAYS_ON (CR0_PG_MASK | CR0_PE_MASK | CR0_NE_MASK)
 
 #define LITEVM_GUEST_CR4_MASK \
 	(CR4_PSE_MASK | CR4_PAE_MASK | CR4_PGE_MASK | CR4_VMXE_MASK | CR4_VME_MASK)
 #define LITEVM_PMODE_VM_CR4_ALWAYS_ON (CR4_VMXE_MASK | CR4_PAE_MASK)
 #define LITEVM_RMODE_VM_CR4_ALWAYS_ON (CR4_VMXE_MASK | CR4_PAE_MASK | CR4_VME_MASK)
+#define LITEVM_EPT_CR4_ALWAYS_ON (CR4_VMXE_MASK)
 
 #define INVALID_PAGE (~(hpa_t)0)
 #define UNMAPPED_GVA (~(gpa_t)0)
@@ -46,11 +55,20 @@
 #define LITEVM_MEMORY_SLOTS 4
 #define LITEVM_NUM_MMU_PAGES 256
 
+/* msrs 0-0x1fff and 0xc0000000-0xc0001fff, see msr_bitmap_index() */
+#define LITEVM_NR_MSR_BITS 0x4000
+
+#define LITEVM_NR_IO_PORTS 0x10000
+
+#define LITEVM_MAX_REPLAY_RECORDS (1 << 20)
+
 #define FX_IMAGE_SIZE 512
 #define FX_IMAGE_ALIGN 16
 #define FX_BUF_SIZE (2 * FX_IMAGE_SIZE + FX_IMAGE_ALIGN)
 
 #define DE_VECTOR 0
+#define DB_VECTOR 1
+#define NM_VECTOR 7
 #define DF_VECTOR 8
 #define TS_VECTOR 10
 #define NP_VECTOR 11
@@ -120,6 +138,7 @@ struct litevm_mmu {
 	hpa_t root_hpa;
 	int root_level;
 	int shadow_root_level;
+	int ept;	/* root_hpa is an ept table, the guest pages itself */
 };
 
 struct litevm_guest_debug {
@@ -150,18 +169,115 @@ enum {
 	NR_VCPU_REGS
 };
 
+/*
+ * Guest vmcs fields that exit handlers read over and over.  They are
+ * cached per vcpu: filled on first use after an exit, and written back
+ * once, before the next entry.  See vcpu_vmcs_readl().
+ */
+enum {
+	VCPU_VMCS_RIP,
+	VCPU_VMCS_RSP,
+	VCPU_VMCS_RFLAGS,
+	VCPU_VMCS_CS_AR,
+	VCPU_VMCS_CR0,
+	VCPU_VMCS_CR0_SHADOW,
+	VCPU_VMCS_CR4,
+	VCPU_VMCS_CR4_SHADOW,
+	VCPU_VMCS_ENTRY_CONTROLS,
+	NR_VCPU_VMCS_CACHED
+};
+
+/* kernel side of a struct litevm_ring_header ring */
+struct litevm_ring {
+	struct litevm_ring_header *hdr;	/* vmalloc_user(), mapped by userspace */
+	/* our copies; userspace could scribble on the ones in hdr */
+	u32 head;
+	u32 size;
+	u32 record_size;
+};
+
+/*
+ * Counters are per vcpu, in cache lines of their own, and only ever
+ * touched by the vcpu's thread; debugfs adds them up when read.  The
+ * blocks live in the vm's stats page, which userspace can map.
+ */
+struct litevm_vcpu_stat {
+	u64 pf_fixed;
+	u64 pf_guest;
+	u64 tlb_flush;
+	u64 invlpg;
+
+	u64 exits;
+	u64 io_exits;
+	u64 mmio_exits;
+	u64 signal_exits;
+	u64 irq_exits;
+	u64 vmwrites_saved;
+	u64 halt_exits;
+	u64 halt_wakeup;
+	u64 halt_wakeup_us;	/* irq to vcpu running again, summed */
+	u64 halt_wakeup_us_max;
+	u64 halt_attempted_poll;
+	u64 halt_successful_poll;
+	u64 halt_poll_us;	/* time spent polling, summed */
+	u64 pause_exits;
+	u64 directed_yield;
+	u64 replay_exits;
+	u64 replay_diverged;
+} ____cacheline_aligned_in_smp;
+
 struct litevm_vcpu {
 	struct litevm *litevm;
 	struct vmcs *vmcs;
 	struct mutex mutex;
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+	struct preempt_notifier preempt_notifier;
+	int preempted;	/* scheduled out while still runnable */
+	struct pid __rcu *pid;	/* thread last running it, for yield_to() */
+#endif
 	int   cpu;
+	struct list_head local_vcpus_link; /* on loaded_vmcss_on_cpu of cpu */
 	int   launched;
+	u16   vpid;		/* tags this vcpu's tlb entries; 0 if none */
+	struct litevm_run *run;	/* shared with userspace, see litevm_dev_fault() */
+	u8 *vapic;	/* virtual-apic page, 0 without tpr shadow */
+	/*
+	 * Set by other threads without the mutex, so atomic bitops only;
+	 * see litevm_dev_ioctl_interrupt().
+	 */
 	unsigned long irq_summary; /* bit vector: 1 per word in irq_pending */
 #define NR_IRQ_WORDS (256 / BITS_PER_LONG)
 	unsigned long irq_pending[NR_IRQ_WORDS];
+	int guest_mode;		/* irqs off on the way in, or in the guest */
+	wait_queue_head_t wq;	/* halted, waiting for irq_pending */
+	ktime_t wakeup_time;	/* when an irq last woke it from halt */
+	unsigned int halt_poll_us; /* spin this long before sleeping */
+	u64 cycle_budget;	/* per LITEVM_RUN, in tsc cycles; or 0 */
+	u64 budget_deadline;	/* tsc, from cycle_budget; or 0 */
+	int preemption_timer;	/* enabled in the vmcs */
+	u64 user_exit_tsc;	/* when the last exit to userspace left, or 0 */
+	u64 sample_period;	/* tsc cycles between rip samples, or 0 */
+	u64 next_sample;	/* tsc */
+	struct litevm_ring sample_ring;
+	struct litevm_ring exit_ring;
+
+	int replay_mode;
+	int replay_pending;	/* replay_exit awaits userspace's completion */
+	struct litevm_replay_record replay_exit;
+	struct litevm_ring replay_ring;		/* recording */
+	struct litevm_replay_record *replay;	/* replaying */
+	u32 replay_pos;
+	u32 replay_len;
+	struct litevm_exit_stats *exit_stats;
+	struct litevm_vcpu_stat *stat;	/* in litevm->stats_page */
+	u32 user_exit_reason;
 	unsigned long regs[NR_VCPU_REGS]; /* for rsp: vcpu_load_rsp_rip() */
 	unsigned long rip;      /* needs vcpu_load_rsp_rip() */
 
+	unsigned long vmcs_cache[NR_VCPU_VMCS_CACHED];
+	u32 vmcs_cache_avail;	/* bit per entry: vmcs_cache[] is valid */
+	u32 vmcs_cache_dirty;	/* bit per entry: not yet in the vmcs */
+
 	unsigned long cr2;
 	unsigned long cr3;
 	unsigned long cr8;
@@ -170,6 +286,18 @@ struct litevm_vcpu {
 	int nmsrs;
 	struct vmx_msr_entry *guest_msrs;
 	struct vmx_msr_entry *host_msrs;
+	int guest_msrs_loaded;	/* NR_BAD_MSRS guest values are in the cpu */
+
+	struct {
+		int loaded;	/* host segments saved, restore in vcpu_put */
+		u16 fs_sel, gs_sel, ldt_sel;
+		int fs_gs_ldt_reload_needed;
+		unsigned long gs_base;
+		/* what the HOST_FS/GS fields of the vmcs hold, if synced */
+		int synced;
+		unsigned long vmcs_fs_sel, vmcs_gs_sel;
+		unsigned long vmcs_fs_base, vmcs_gs_base;
+	} host_state;
 
 	struct list_head free_pages;
 	struct litevm_mmu_page page_header_buf[LITEVM_NUM_MMU_PAGES];
@@ -180,6 +308,9 @@ struct litevm_vcpu {
 	char fx_buf[FX_BUF_SIZE];
 	char *host_fx_image;
 	char *guest_fx_image;
+	int fpu_active;		/* guest fx image is switched in on entry */
+
+	int msr_exit;	/* rdmsr/wrmsr waiting on userspace, MSR_EXIT_* */
 
 	int mmio_needed;
 	int mmio_read_completed;
@@ -199,6 +330,21 @@ struct litevm_vcpu {
 	} rmode;
 };
 
+/*
+ * Per-vcpu exit accounting, summed in debugfs as litevm/<vm>/exit_stats.
+ * Histogram bucket n counts events of 2^(n-1) up to 2^n tsc cycles.
+ */
+#define LITEVM_NR_EXIT_STATS 64	/* vmx exit reasons; the last one, any above */
+#define LITEVM_NR_USER_EXITS 16	/* enum litevm_exit_reason */
+#define LITEVM_HIST_BUCKETS 32
+
+struct litevm_exit_stats {
+	u64 count[LITEVM_NR_EXIT_STATS];
+	u64 handler[LITEVM_NR_EXIT_STATS][LITEVM_HIST_BUCKETS];
+	/* from returning to userspace until the next run, by exit_reason */
+	u64 user[LITEVM_NR_USER_EXITS][LITEVM_HIST_BUCKETS];
+};
+
 struct litevm_memory_slot {
 	gfn_t base_gfn;
 	unsigned long npages;
@@ -215,23 +361,18 @@ struct litevm {
 	struct litevm_vcpu vcpus[LITEVM_MAX_VCPUS];
 	int memory_config_version;
 	int busy;
+	int ept;	/* use ept instead of shadow paging when the guest pages */
+	int last_boosted_vcpu;	/* where the next directed yield looks first */
+	unsigned long *msr_bitmap;	/* vmx layout, bit set: exit */
+	DECLARE_BITMAP(msr_user, LITEVM_NR_MSR_BITS); /* forward to userspace */
+	unsigned long *io_bitmap;	/* vmx bitmaps a and b, bit set: exit */
+	unsigned long *io_ignore;	/* bit per port: LITEVM_IO_IGNORE */
+	struct list_head vm_list;	/* on vm_list, for the global stats */
+	atomic_t users;		/* the fd, and open debugfs files */
+	struct dentry *debugfs_dir;
+	void *stats_page;	/* struct litevm_stats_header, and the counters */
 };
 
-struct litevm_stat {
-	u32 pf_fixed;
-	u32 pf_guest;
-	u32 tlb_flush;
-	u32 invlpg;
-
-	u32 exits;
-	u32 io_exits;
-	u32 mmio_exits;
-	u32 signal_exits;
-	u32 irq_exits;
-};
-
-extern struct litevm_stat litevm_stat;
-
 #define litevm_printf(litevm, fmt ...) printk(KERN_DEBUG fmt)
 #define vcpu_printf(vcpu, fmt...) litevm_printf(vcpu->litevm, fmt)
 
@@ -239,6 +380,8 @@ void litevm_mmu_destroy(struct litevm_vcpu *vcpu);
 int litevm_mmu_init(struct litevm_vcpu *vcpu);
 
 int litevm_mmu_reset_context(struct litevm_vcpu *vcpu);
+int litevm_mmu_mode_changed(struct litevm_vcpu *vcpu);
+
 void litevm_mmu_slot_remove_write_access(struct litevm *litevm, int slot);
 
 hpa_t gpa_to_hpa(struct litevm_vcpu *vcpu, gpa_t gpa);
@@ -279,6 +422,11 @@ int litevm_write_guest(struct litevm_vcpu *vcpu,
 void vmcs_writel(unsigned long field, unsigned long value);
 unsigned long vmcs_readl(unsigned long field);
 
+void flush_guest_tlb(struct litevm_vcpu *vcpu);
+void flush_guest_tlb_page(struct litevm_vcpu *vcpu, gva_t gva);
+void flush_guest_tlb_nonglobal(struct litevm_vcpu *vcpu);
+void litevm_set_ept(struct litevm_vcpu *vcpu, int enable);
+
 static inline u16 vmcs_read16(unsigned long field)
 {
 	return vmcs_readl(field);
@@ -303,31 +451,69 @@ static inline void vmcs_write32(unsigned long field, u32 value)
 	vmcs_writel(field, value);
 }
 
-static inline int is_long_mode(void)
+static inline void vmcs_write64(unsigned long field, u64 value)
+{
+#ifdef __x86_64__
+	vmcs_writel(field, value);
+#else
+	vmcs_writel(field, value);
+	asm volatile ("");
+	vmcs_writel(field+1, value >> 32);
+#endif
+}
+
+extern const unsigned long litevm_vmcs_cached_field[NR_VCPU_VMCS_CACHED];
+
+/*
+ * Cached access to the VCPU_VMCS_* fields.  Anything that vmreads or
+ * vmwrites one of them directly must do so with the cache empty, i.e.
+ * right after vcpu_load().
+ */
+static inline unsigned long vcpu_vmcs_readl(struct litevm_vcpu *vcpu, int i)
+{
+	if (!(vcpu->vmcs_cache_avail & (1u << i))) {
+		vcpu->vmcs_cache[i] = vmcs_readl(litevm_vmcs_cached_field[i]);
+		vcpu->vmcs_cache_avail |= 1u << i;
+	}
+	return vcpu->vmcs_cache[i];
+}
+
+static inline void vcpu_vmcs_writel(struct litevm_vcpu *vcpu, int i,
+				    unsigned long value)
 {
-	return vmcs_read32(VM_ENTRY_CONTROLS) & VM_ENTRY_CONTROLS_IA32E_MASK;
+	vcpu->vmcs_cache[i] = value;
+	vcpu->vmcs_cache_avail |= 1u << i;
+	vcpu->vmcs_cache_dirty |= 1u << i;
 }
 
-static inline unsigned long guest_cr4(void)
+static inline int is_long_mode(struct litevm_vcpu *vcpu)
 {
-	return (vmcs_readl(CR4_READ_SHADOW) & LITEVM_GUEST_CR4_MASK) |
-		(vmcs_readl(GUEST_CR4) & ~LITEVM_GUEST_CR4_MASK);
+	return vcpu_vmcs_readl(vcpu, VCPU_VMCS_ENTRY_CONTROLS)
+		& VM_ENTRY_CONTROLS_IA32E_MASK;
 }
 
-static inline int is_pae(void)
+static inline unsigned long guest_cr4(struct litevm_vcpu *vcpu)
 {
-	return guest_cr4() & CR4_PAE_MASK;
+	return (vcpu_vmcs_readl(vcpu, VCPU_VMCS_CR4_SHADOW)
+		& LITEVM_GUEST_CR4_MASK) |
+		(vcpu_vmcs_readl(vcpu, VCPU_VMCS_CR4) & ~LITEVM_GUEST_CR4_MASK);
 }
 
-static inline int is_pse(void)
+static inline int is_pae(struct litevm_vcpu *vcpu)
 {
-	return guest_cr4() & CR4_PSE_MASK;
+	return guest_cr4(vcpu) & CR4_PAE_MASK;
 }
 
-static inline unsigned long guest_cr0(void)
+static inline int is_pse(struct litevm_vcpu *vcpu)
 {
-	return (vmcs_readl(CR0_READ_SHADOW) & LITEVM_GUEST_CR0_MASK) |
-		(vmcs_readl(GUEST_CR0) & ~LITEVM_GUEST_CR0_MASK);
+	return guest_cr4(vcpu) & CR4_PSE_MASK;
+}
+
+static inline unsigned long guest_cr0(struct litevm_vcpu *vcpu)
+{
+	return (vcpu_vmcs_readl(vcpu, VCPU_VMCS_CR0_SHADOW)
+		& LITEVM_GUEST_CR0_MASK) |
+		(vcpu_vmcs_readl(vcpu, VCPU_VMCS_CR0) & ~LITEVM_GUEST_CR0_MASK);
 }
 
 static inline unsigned guest_cpl(void)
@@ -335,9 +521,9 @@ static inline unsigned guest_cpl(void)
 	return vmcs_read16(GUEST_CS_SELECTOR) & SELECTOR_RPL_MASK;
 }
 
-static inline int is_paging(void)
+static inline int is_paging(struct litevm_vcpu *vcpu)
 {
-	return guest_cr0() & CR0_PG_MASK;
+	return guest_cr0(vcpu) & CR0_PG_MASK;
 }
 
 static inline int is_page_fault(u32 intr_info)
@@ -353,11 +539,6 @@ static inline int is_external_interrupt(u32 intr_info)
 		== (INTR_TYPE_EXT_INTR | INTR_INFO_VALID_MASK);
 }
 
-static inline void flush_guest_tlb(struct litevm_vcpu *vcpu)
-{
-	vmcs_writel(GUEST_CR3, vmcs_readl(GUEST_CR3));
-}
-
 static inline int memslot_id(struct litevm *litevm, struct litevm_memory_slot *slot)
 {
 	return slot - litevm->memslots;
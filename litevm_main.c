@@ -33,29 +33,69 @@
 #include <linux/slab.h>
 #include <asm/debugreg.h>
 #include <linux/sched.h>
+#include <linux/seq_file.h>
 
 #include "vmx.h"
 #include "x86_emulate.h"
 
+#define CREATE_TRACE_POINTS
+#include "litevm_trace.h"
+
 MODULE_AUTHOR("Qumranet");
 MODULE_LICENSE("GPL");
 
-struct litevm_stat litevm_stat;
+/*
+ * Upper bound on how long a halted vcpu spins waiting for an irq before
+ * going to sleep; 0 turns polling off.  Each vcpu adapts its own window
+ * below this, see grow_halt_poll().
+ */
+static unsigned int halt_poll_max_us = 200;
+module_param(halt_poll_max_us, uint, 0644);
+
+#define HALT_POLL_START_US 10
+
+/*
+ * Pause-loop exiting: a guest executing pause instructions no more than
+ * ple_gap cycles apart for longer than ple_window cycles is taken to be
+ * spinning on a lock.  ple_gap 0 turns it off.
+ */
+static unsigned int ple_gap = 128;
+module_param(ple_gap, uint, 0444);
+static unsigned int ple_window = 4096;
+module_param(ple_window, uint, 0444);
+
+static LIST_HEAD(vm_list);
+static DEFINE_SPINLOCK(vm_list_lock);
+
+#define VCPU_STAT(x) offsetof(struct litevm_vcpu_stat, x)
 
 static struct litevm_stats_debugfs_item {
 	const char *name;
-	u32 *data;
+	int offset;
+	int max;	/* combine by taking the largest, not the sum */
 	struct dentry *dentry;
 } debugfs_entries[] = {
-	{ "pf_fixed", &litevm_stat.pf_fixed },
-	{ "pf_guest", &litevm_stat.pf_guest },
-	{ "tlb_flush", &litevm_stat.tlb_flush },
-	{ "invlpg", &litevm_stat.invlpg },
-	{ "exits", &litevm_stat.exits },
-	{ "io_exits", &litevm_stat.io_exits },
-	{ "mmio_exits", &litevm_stat.mmio_exits },
-	{ "signal_exits", &litevm_stat.signal_exits },
-	{ "irq_exits", &litevm_stat.irq_exits },
+	{ "pf_fixed", VCPU_STAT(pf_fixed) },
+	{ "pf_guest", VCPU_STAT(pf_guest) },
+	{ "tlb_flush", VCPU_STAT(tlb_flush) },
+	{ "invlpg", VCPU_STAT(invlpg) },
+	{ "exits", VCPU_STAT(exits) },
+	{ "io_exits", VCPU_STAT(io_exits) },
+	{ "mmio_exits", VCPU_STAT(mmio_exits) },
+	{ "signal_exits", VCPU_STAT(signal_exits) },
+	{ "irq_exits", VCPU_STAT(irq_exits) },
+	{ "vmwrites_saved", VCPU_STAT(vmwrites_saved) },
+	{ "halt_exits", VCPU_STAT(halt_exits) },
+	{ "halt_wakeup", VCPU_STAT(halt_wakeup) },
+	{ "halt_wakeup_us", VCPU_STAT(halt_wakeup_us) },
+	{ "halt_wakeup_us_max", VCPU_STAT(halt_wakeup_us_max), 1 },
+	{ "halt_attempted_poll", VCPU_STAT(halt_attempted_poll) },
+	{ "halt_successful_poll", VCPU_STAT(halt_successful_poll) },
+	{ "halt_poll_us", VCPU_STAT(halt_poll_us) },
+	{ "pause_exits", VCPU_STAT(pause_exits) },
+	{ "directed_yield", VCPU_STAT(directed_yield) },
+	{ "replay_exits", VCPU_STAT(replay_exits) },
+	{ "replay_diverged", VCPU_STAT(replay_diverged) },
 	{ 0, 0 }
 };
 
@@ -90,6 +130,9 @@ static const u32 vmx_msr_index[] = {
 #define MSR_IA32_VMX_PROCBASED_CTLS_MSR		0x482
 #define MSR_IA32_VMX_EXIT_CTLS_MSR		0x483
 #define MSR_IA32_VMX_ENTRY_CTLS_MSR		0x484
+#define MSR_IA32_VMX_MISC			0x485
+#define MSR_IA32_VMX_PROCBASED_CTLS2		0x48b
+#define MSR_IA32_VMX_EPT_VPID_CAP		0x48c
 
 #define CR0_RESEVED_BITS 0xffffffff1ffaffc0ULL
 #define LMSW_GUEST_MASK 0x0eULL
@@ -114,6 +157,156 @@ static struct vmx_msr_entry *find_msr_entry(struct litevm_vcpu *vcpu, u32 msr)
 	return 0;
 }
 
+/*
+ * The vmx msr bitmap has a read and a write bit for each of msrs 0-0x1fff
+ * and 0xc0000000-0xc0001fff.  Accesses to anything else always exit.
+ */
+#define MSR_BITMAP_WRITE_OFFSET (LITEVM_NR_MSR_BITS)
+
+#define MSR_EXIT_READ  1
+#define MSR_EXIT_WRITE 2
+
+static int msr_bitmap_index(u32 msr)
+{
+	if (msr <= 0x1fff)
+		return msr;
+	if (msr >= 0xc0000000 && msr <= 0xc0001fff)
+		return 0x2000 + (msr & 0x1fff);
+	return -1;
+}
+
+/*
+ * Msrs the guest may own: the cpu switches them at vm entry and exit,
+ * as guest state in the vmcs or through the msr autoload lists.  These
+ * are passed through by default.
+ */
+static const u32 msr_passthrough_ok[] = {
+#ifdef __x86_64__
+	MSR_FS_BASE, MSR_GS_BASE, MSR_KERNEL_GS_BASE,
+#endif
+	MSR_IA32_SYSENTER_CS, MSR_IA32_SYSENTER_ESP, MSR_IA32_SYSENTER_EIP,
+};
+#define NR_MSR_PASSTHROUGH_OK \
+	(sizeof(msr_passthrough_ok) / sizeof(*msr_passthrough_ok))
+
+static int litevm_set_msr_policy(struct litevm *litevm, u32 msr, int policy)
+{
+	int i = msr_bitmap_index(msr);
+	int j;
+
+	if (i < 0)
+		return -EINVAL;
+
+	switch (policy) {
+	case LITEVM_MSR_PASSTHROUGH:
+		for (j = 0; j < NR_MSR_PASSTHROUGH_OK; ++j)
+			if (msr_passthrough_ok[j] == msr)
+				break;
+		if (j == NR_MSR_PASSTHROUGH_OK)
+			return -EPERM;
+		clear_bit(i, litevm->msr_user);
+		clear_bit(i, litevm->msr_bitmap);
+		clear_bit(MSR_BITMAP_WRITE_OFFSET + i, litevm->msr_bitmap);
+		break;
+	case LITEVM_MSR_USERSPACE:
+		/* we track efer for long mode; it can't live elsewhere */
+		if (msr == MSR_EFER)
+			return -EPERM;
+		/* fall through */
+	case LITEVM_MSR_INTERCEPT:
+		set_bit(i, litevm->msr_bitmap);
+		set_bit(MSR_BITMAP_WRITE_OFFSET + i, litevm->msr_bitmap);
+		if (policy == LITEVM_MSR_USERSPACE)
+			set_bit(i, litevm->msr_user);
+		else
+			clear_bit(i, litevm->msr_user);
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int alloc_msr_bitmap(struct litevm *litevm)
+{
+	int i;
+
+	litevm->msr_bitmap = (unsigned long *)__get_free_page(GFP_KERNEL);
+	if (!litevm->msr_bitmap)
+		return -ENOMEM;
+	memset(litevm->msr_bitmap, 0xff, PAGE_SIZE);
+	for (i = 0; i < NR_MSR_PASSTHROUGH_OK; ++i)
+		litevm_set_msr_policy(litevm, msr_passthrough_ok[i],
+				      LITEVM_MSR_PASSTHROUGH);
+	return 0;
+}
+
+/*
+ * I/O bitmaps: bit set, the port exits.  Ports start out forwarded to
+ * userspace, except the ones no vmm wants to see.
+ */
+#define IO_BITMAP_ORDER 1	/* bitmaps a and b, back to back */
+
+static const u16 io_ignore_default[] = {
+	0x80,	/* post codes, and writes used as an i/o delay */
+};
+
+static void set_io_policy(struct litevm *litevm, u16 port, int policy)
+{
+	if (policy == LITEVM_IO_PASSTHROUGH)
+		clear_bit(port, litevm->io_bitmap);
+	else
+		set_bit(port, litevm->io_bitmap);
+	if (policy == LITEVM_IO_IGNORE)
+		set_bit(port, litevm->io_ignore);
+	else
+		clear_bit(port, litevm->io_ignore);
+}
+
+static int alloc_io_bitmaps(struct litevm *litevm)
+{
+	int i;
+
+	litevm->io_bitmap = (unsigned long *)__get_free_pages(GFP_KERNEL,
+							      IO_BITMAP_ORDER);
+	if (!litevm->io_bitmap)
+		return -ENOMEM;
+	litevm->io_ignore = kzalloc(LITEVM_NR_IO_PORTS / 8, GFP_KERNEL);
+	if (!litevm->io_ignore) {
+		free_pages((unsigned long)litevm->io_bitmap, IO_BITMAP_ORDER);
+		return -ENOMEM;
+	}
+	memset(litevm->io_bitmap, 0xff, PAGE_SIZE << IO_BITMAP_ORDER);
+	for (i = 0; i < ARRAY_SIZE(io_ignore_default); ++i)
+		set_io_policy(litevm, io_ignore_default[i], LITEVM_IO_IGNORE);
+	return 0;
+}
+
+static void free_io_bitmaps(struct litevm *litevm)
+{
+	free_pages((unsigned long)litevm->io_bitmap, IO_BITMAP_ORDER);
+	kfree(litevm->io_ignore);
+}
+
+static int litevm_dev_ioctl_set_io_policy(struct litevm *litevm,
+					  struct litevm_io_policy *p)
+{
+	u32 port;
+
+	if (p->port >= LITEVM_NR_IO_PORTS ||
+	    p->count > LITEVM_NR_IO_PORTS - p->port)
+		return -EINVAL;
+	if (p->policy > LITEVM_IO_PASSTHROUGH)
+		return -EINVAL;
+	/* the guest gets the real port, with no vmm in the way */
+	if (p->policy == LITEVM_IO_PASSTHROUGH && !capable(CAP_SYS_RAWIO))
+		return -EPERM;
+
+	for (port = p->port; port < p->port + p->count; ++port)
+		set_io_policy(litevm, port, p->policy);
+	return 0;
+}
+
 struct descriptor_table {
 	u16 limit;
 	unsigned long base;
@@ -261,6 +454,8 @@ static void reload_tss(void)
 
 static DEFINE_PER_CPU(struct vmcs *, vmxarea);
 static DEFINE_PER_CPU(struct vmcs *, current_vmcs);
+/* vcpus whose vmcs may be active on this cpu, linked by local_vcpus_link */
+static DEFINE_PER_CPU(struct list_head, loaded_vmcss_on_cpu);
 
 static struct vmcs_descriptor {
 	int size;
@@ -361,6 +556,217 @@ static __init void setup_vmcs_descriptor(void)
 	vmcs_descriptor.revision_id = vmx_msr_low;
 };
 
+/*
+ * Virtual processor ids.  Each vcpu gets its own, so guest tlb entries
+ * survive vm entry and exit and need flushing only when the shadow page
+ * tables change.  vpid 0 belongs to the host.
+ */
+#define VMX_NR_VPIDS 65536
+
+static int vmx_has_vpid;
+static int vmx_invvpid_types;	/* bit per VMX_VPID_EXTENT_* supported */
+static DECLARE_BITMAP(vpid_bitmap, VMX_NR_VPIDS);
+static DEFINE_SPINLOCK(vpid_lock);
+
+static __init int cpu_has_secondary_exec(u32 control)
+{
+	u32 vmx_msr_low, vmx_msr_high;
+
+	rdmsr(MSR_IA32_VMX_PROCBASED_CTLS_MSR, vmx_msr_low, vmx_msr_high);
+	if (!(vmx_msr_high & CPU_BASED_ACTIVATE_SECONDARY_CONTROLS))
+		return 0;
+	rdmsr(MSR_IA32_VMX_PROCBASED_CTLS2, vmx_msr_low, vmx_msr_high);
+	return (vmx_msr_high & control) != 0;
+}
+
+static __init void setup_vpid(void)
+{
+	u32 vmx_msr_low, vmx_msr_high;
+
+	if (!cpu_has_secondary_exec(SECONDARY_EXEC_ENABLE_VPID))
+		return;
+
+	/* invvpid support and its extents live in the high dword, 23.6 */
+	rdmsr(MSR_IA32_VMX_EPT_VPID_CAP, vmx_msr_low, vmx_msr_high);
+	if (!(vmx_msr_high & 1))
+		return;
+	vmx_invvpid_types = (vmx_msr_high >> 8) & 0xf;
+	if (!(vmx_invvpid_types & ((1 << VMX_VPID_EXTENT_SINGLE_CONTEXT) |
+				   (1 << VMX_VPID_EXTENT_ALL_CONTEXT))))
+		return;
+
+	__set_bit(0, vpid_bitmap);
+	vmx_has_vpid = 1;
+}
+
+/*
+ * With a tpr shadow the guest's cr8 lives in a virtual-apic page and
+ * mov to/from cr8 runs without exiting.
+ */
+static int vmx_has_tpr_shadow;
+
+#define VAPIC_TPR 0x80	/* task priority, cr8 in bits 7:4 */
+
+static __init void setup_tpr_shadow(void)
+{
+	u32 vmx_msr_low, vmx_msr_high;
+
+	rdmsr(MSR_IA32_VMX_PROCBASED_CTLS_MSR, vmx_msr_low, vmx_msr_high);
+	vmx_has_tpr_shadow = (vmx_msr_high & CPU_BASED_TPR_SHADOW) != 0;
+}
+
+/*
+ * The preemption timer counts down at the tsc rate divided by
+ * 2^vmx_preemption_timer_shift; -1 if there is none.
+ */
+static int vmx_preemption_timer_shift = -1;
+
+static __init void setup_preemption_timer(void)
+{
+	u32 vmx_msr_low, vmx_msr_high;
+
+	rdmsr(MSR_IA32_VMX_PINBASED_CTLS_MSR, vmx_msr_low, vmx_msr_high);
+	if (!(vmx_msr_high & PIN_BASED_VMX_PREEMPTION_TIMER))
+		return;
+	rdmsr(MSR_IA32_VMX_MISC, vmx_msr_low, vmx_msr_high);
+	vmx_preemption_timer_shift = vmx_msr_low & 0x1f;
+}
+
+/* Pause-loop exiting, tuned by ple_gap and ple_window above. */
+static int vmx_has_ple;
+
+static __init void setup_ple(void)
+{
+	vmx_has_ple = cpu_has_secondary_exec(SECONDARY_EXEC_PAUSE_LOOP_EXITING)
+		&& ple_gap;
+}
+
+/*
+ * Extended page tables: see ept_init_context() in mmu.c.  A vm uses them
+ * if the cpu can walk four levels of write-back tables and has invept.
+ */
+static int vmx_has_ept;
+static int vmx_invept_types;	/* bit per VMX_EPT_EXTENT_* supported */
+
+static __init void setup_ept(void)
+{
+	u64 cap;
+
+	if (!cpu_has_secondary_exec(SECONDARY_EXEC_ENABLE_EPT))
+		return;
+
+	rdmsrl(MSR_IA32_VMX_EPT_VPID_CAP, cap);
+	if (!(cap & (1 << 6))		/* page walk length 4 */
+	    || !(cap & (1 << 14))	/* write-back ept tables */
+	    || !(cap & (1 << 20)))	/* invept */
+		return;
+	vmx_invept_types = (cap >> 24) & 0x6;
+	if (!vmx_invept_types)
+		return;
+
+	vmx_has_ept = 1;
+}
+
+static u64 construct_eptp(hpa_t root_hpa)
+{
+	return root_hpa | (VMX_EPT_DEFAULT_GAW << 3) | VMX_EPT_MT_WB;
+}
+
+static void __invept(int ext, u64 eptp)
+{
+	struct {
+		u64 eptp;
+		u64 gpa;
+	} operand = { eptp, 0 };
+
+	asm volatile ("invept %0, %1"
+		      : : "m"(operand), "r"((unsigned long)ext)
+		      : "cc", "memory");
+}
+
+static void allocate_vpid(struct litevm_vcpu *vcpu)
+{
+	int vpid;
+
+	vcpu->vpid = 0;
+	if (!vmx_has_vpid)
+		return;
+	spin_lock(&vpid_lock);
+	vpid = find_first_zero_bit(vpid_bitmap, VMX_NR_VPIDS);
+	if (vpid < VMX_NR_VPIDS) {
+		vcpu->vpid = vpid;
+		__set_bit(vpid, vpid_bitmap);
+	}
+	spin_unlock(&vpid_lock);
+}
+
+static void free_vpid(struct litevm_vcpu *vcpu)
+{
+	if (!vcpu->vpid)
+		return;
+	spin_lock(&vpid_lock);
+	__clear_bit(vcpu->vpid, vpid_bitmap);
+	spin_unlock(&vpid_lock);
+	vcpu->vpid = 0;
+}
+
+static void __invvpid(int ext, u16 vpid, gva_t gva)
+{
+	struct {
+		u64 vpid : 16;
+		u64 rsvd : 48;
+		u64 gva;
+	} operand = { vpid, 0, gva };
+
+	asm volatile ("invvpid %0, %1"
+		      : : "m"(operand), "r"((unsigned long)ext)
+		      : "cc", "memory");
+}
+
+/*
+ * Falls back to the next wider extent the cpu supports; all-context
+ * is always there if we enabled vpids at all.
+ */
+static void vpid_flush(struct litevm_vcpu *vcpu, int ext, gva_t gva)
+{
+	if (!vcpu->vpid)
+		return;
+	if (ext == VMX_VPID_EXTENT_INDIVIDUAL_ADDR ||
+	    ext == VMX_VPID_EXTENT_SINGLE_NON_GLOBAL)
+		if (!(vmx_invvpid_types & (1 << ext)))
+			ext = VMX_VPID_EXTENT_SINGLE_CONTEXT;
+	if (ext == VMX_VPID_EXTENT_SINGLE_CONTEXT &&
+	    !(vmx_invvpid_types & (1 << ext)))
+		ext = VMX_VPID_EXTENT_ALL_CONTEXT;
+	__invvpid(ext, vcpu->vpid, gva);
+}
+
+/*
+ * Without a vpid every vm entry and exit flushes the guest's linear
+ * translations, so there is nothing to do.  Translations through ept
+ * tables are never flushed by the cpu on its own and need invept.
+ */
+void flush_guest_tlb(struct litevm_vcpu *vcpu)
+{
+	if (vcpu->mmu.ept) {
+		__invept(vmx_invept_types & (1 << VMX_EPT_EXTENT_CONTEXT) ?
+			 VMX_EPT_EXTENT_CONTEXT : VMX_EPT_EXTENT_GLOBAL,
+			 construct_eptp(vcpu->mmu.root_hpa));
+		return;
+	}
+	vpid_flush(vcpu, VMX_VPID_EXTENT_SINGLE_CONTEXT, 0);
+}
+
+void flush_guest_tlb_page(struct litevm_vcpu *vcpu, gva_t gva)
+{
+	vpid_flush(vcpu, VMX_VPID_EXTENT_INDIVIDUAL_ADDR, gva);
+}
+
+void flush_guest_tlb_nonglobal(struct litevm_vcpu *vcpu)
+{
+	vpid_flush(vcpu, VMX_VPID_EXTENT_SINGLE_NON_GLOBAL, 0);
+}
+
 static void vmcs_clear(struct vmcs *vmcs)
 {
 	u64 phys_addr = __pa(vmcs);
@@ -373,35 +779,55 @@ static void vmcs_clear(struct vmcs *vmcs)
 		       vmcs, phys_addr);
 }
 
+/*
+ * Runs on the cpu the vmcs was last loaded on, with interrupts disabled
+ * (from an ipi, or from litevm_disable()).
+ */
 static void __vcpu_clear(void *arg)
 {
 	struct litevm_vcpu *vcpu = arg;
 	int cpu = smp_processor_id();
 
-	if (vcpu->cpu == cpu)
+	if (vcpu->cpu == cpu) {
 		vmcs_clear(vcpu->vmcs);
+		list_del(&vcpu->local_vcpus_link);
+		vcpu->cpu = -1;
+	}
 	if (per_cpu(current_vmcs, cpu) == vcpu->vmcs)
 		per_cpu(current_vmcs, cpu) = 0;
 }
 
+/*
+ * Clears the vmcs on the one cpu that may hold it, instead of asking
+ * every cpu in the system.
+ */
+static void vcpu_clear(struct litevm_vcpu *vcpu)
+{
+	if (vcpu->cpu != -1)
+		smp_call_function_single(vcpu->cpu, __vcpu_clear, vcpu, 1);
+}
+
 static int vcpu_slot(struct litevm_vcpu *vcpu)
 {
 	return vcpu - vcpu->litevm->vcpus;
 }
 
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+static struct preempt_ops litevm_preempt_ops;
+#endif
+
 /*
- * Switches to specified vcpu, until a matching vcpu_put(), but assumes
- * vcpu mutex is already taken.
+ * Makes the vcpu's vmcs current on this cpu.  Called with preemption
+ * disabled, either from __vcpu_load() or when the scheduler brings the
+ * vcpu thread back in.
  */
-static struct litevm_vcpu *__vcpu_load(struct litevm_vcpu *vcpu)
+static void vcpu_load_cpu(struct litevm_vcpu *vcpu, int cpu)
 {
 	u64 phys_addr = __pa(vcpu->vmcs);
-	int cpu;
-
-	cpu = get_cpu();
+	int migrated = vcpu->cpu != cpu;
 
-	if (vcpu->cpu != cpu) {
-		smp_call_function(__vcpu_clear, vcpu, 1);
+	if (migrated) {
+		vcpu_clear(vcpu);
 		vcpu->launched = 0;
 	}
 
@@ -416,11 +842,23 @@ static struct litevm_vcpu *__vcpu_load(struct litevm_vcpu *vcpu)
 			       vcpu->vmcs, phys_addr);
 	}
 
-	if (vcpu->cpu != cpu) {
+	if (migrated) {
 		struct descriptor_table dt;
 		unsigned long sysenter_esp;
+		unsigned long flags;
 
+		local_irq_save(flags);
 		vcpu->cpu = cpu;
+		list_add(&vcpu->local_vcpus_link,
+			 &per_cpu(loaded_vmcss_on_cpu, cpu));
+		local_irq_restore(flags);
+
+		/*
+		 * This cpu may still hold entries tagged with our vpid from
+		 * the last time we ran here.
+		 */
+		flush_guest_tlb(vcpu);
+
 		/*
 		 * Linux uses per-cpu TSS and GDT, so set these when switching
 		 * processors.
@@ -432,6 +870,26 @@ static struct litevm_vcpu *__vcpu_load(struct litevm_vcpu *vcpu)
 		rdmsrl(MSR_IA32_SYSENTER_ESP, sysenter_esp);
 		vmcs_writel(HOST_IA32_SYSENTER_ESP, sysenter_esp); /* 22.2.3 */
 	}
+}
+
+/*
+ * Switches to specified vcpu, until a matching vcpu_put(), but assumes
+ * vcpu mutex is already taken.
+ *
+ * With preempt notifiers the vcpu stays preemptible while loaded; the
+ * scheduler hooks below save and restore the cpu state around a switch.
+ * Without them, preemption stays disabled until vcpu_put().
+ */
+static struct litevm_vcpu *__vcpu_load(struct litevm_vcpu *vcpu)
+{
+	int cpu;
+
+	cpu = get_cpu();
+	vcpu_load_cpu(vcpu, cpu);
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+	preempt_notifier_register(&vcpu->preempt_notifier);
+	put_cpu();
+#endif
 	return vcpu;
 }
 
@@ -450,59 +908,329 @@ static struct litevm_vcpu *vcpu_load(struct litevm *litevm, int vcpu_slot)
 	return __vcpu_load(vcpu);
 }
 
-static void vcpu_put(struct litevm_vcpu *vcpu)
+static void update_exception_bitmap(struct litevm_vcpu *vcpu)
 {
-	put_cpu();
-	mutex_unlock(&vcpu->mutex);
-}
+	u32 eb;
 
+	if (vcpu->rmode.active)
+		eb = ~0;
+	else {
+		eb = vcpu->mmu.ept ? 0 : 1u << PF_VECTOR;
+		if (!vcpu->fpu_active)
+			eb |= 1u << NM_VECTOR;
+	}
+	if (vcpu->guest_debug.enabled)
+		eb |= 1u << DB_VECTOR;
+	vmcs_write32(EXCEPTION_BITMAP, eb);
+}
 
-static struct vmcs *alloc_vmcs_cpu(int cpu)
+/*
+ * The guest sees CR0.TS from the read shadow; the real bit stays set while
+ * its fpu state is not loaded so that the first fpu instruction traps.
+ */
+static void set_guest_cr0(struct litevm_vcpu *vcpu, unsigned long cr0)
 {
-	int node = cpu_to_node(cpu);
-	struct page *pages;
-	struct vmcs *vmcs;
+	unsigned long hw_cr0 = cr0 | (vcpu->mmu.ept ? LITEVM_EPT_CR0_ALWAYS_ON
+					      : LITEVM_VM_CR0_ALWAYS_ON);
 
-	pages = alloc_pages_node(node, GFP_KERNEL, vmcs_descriptor.order);
-	if (!pages)
-		return 0;
-	vmcs = page_address(pages);
-	memset(vmcs, 0, vmcs_descriptor.size);
-	vmcs->revision_id = vmcs_descriptor.revision_id; /* vmcs revision id */
-	return vmcs;
+	if (!vcpu->fpu_active)
+		hw_cr0 |= CR0_TS_MASK;
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_CR0_SHADOW, cr0);
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_CR0, hw_cr0);
 }
 
-static struct vmcs *alloc_vmcs(void)
+/*
+ * Lazy fpu switching: the guest fpu state is only switched in around
+ * entries once the guest has taken #NM, and that stops again when the
+ * vcpu is put.  Exit handlers can be preempted, and litevm_sched_out()
+ * goes by fpu_active, so the flag and the vmcs change together with
+ * preemption off.
+ */
+static void litevm_load_guest_fpu(struct litevm_vcpu *vcpu)
 {
-	return alloc_vmcs_cpu(smp_processor_id());
+	preempt_disable();
+	if (!vcpu->fpu_active) {
+		vcpu->fpu_active = 1;
+		set_guest_cr0(vcpu,
+			      vcpu_vmcs_readl(vcpu, VCPU_VMCS_CR0_SHADOW));
+		update_exception_bitmap(vcpu);
+	}
+	preempt_enable();
 }
 
-static void free_vmcs(struct vmcs *vmcs)
+static void litevm_put_guest_fpu(struct litevm_vcpu *vcpu)
 {
-	free_pages((unsigned long)vmcs, vmcs_descriptor.order);
+	if (!vcpu->fpu_active)
+		return;
+	vcpu->fpu_active = 0;
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_CR0, vcpu_vmcs_readl(vcpu, VCPU_VMCS_CR0) | CR0_TS_MASK);
+	update_exception_bitmap(vcpu);
 }
 
-static __init int cpu_has_litevm_support(void)
+static void load_msrs(struct vmx_msr_entry *e, int n)
 {
-	unsigned long ecx = cpuid_ecx(1);
-	return test_bit(5, &ecx); /* CPUID.1:ECX.VMX[bit 5] -> VT */
+	int i;
+
+	for (i = 0; i < n; ++i)
+		wrmsrl(e[i].index, e[i].data);
 }
 
-static void free_litevm_area(void)
+static void save_msrs(struct vmx_msr_entry *e, int n)
 {
-	int cpu;
+	int i;
 
-	for_each_online_cpu(cpu)
-		free_vmcs(per_cpu(vmxarea, cpu));
+	for (i = 0; i < n; ++i)
+		rdmsrl(e[i].index, e[i].data);
 }
 
-static __init int alloc_litevm_area(void)
+/*
+ * The msrs that cannot go through the vmcs autoload lists are switched
+ * by hand.  Once loaded, the guest values stay in the cpu across exits
+ * handled in the kernel, and the host values come back in vcpu_put().
+ */
+static void litevm_load_guest_msrs(struct litevm_vcpu *vcpu)
 {
-	int cpu;
+	if (vcpu->guest_msrs_loaded)
+		return;
+	save_msrs(vcpu->host_msrs, vcpu->nmsrs);
+	load_msrs(vcpu->guest_msrs, NR_BAD_MSRS);
+	vcpu->guest_msrs_loaded = 1;
+}
 
-	for_each_online_cpu(cpu) {
-		struct vmcs *vmcs;
+static void litevm_put_guest_msrs(struct litevm_vcpu *vcpu)
+{
+	if (!vcpu->guest_msrs_loaded)
+		return;
+	save_msrs(vcpu->guest_msrs, NR_BAD_MSRS);
+	load_msrs(vcpu->host_msrs, NR_BAD_MSRS);
+	vcpu->guest_msrs_loaded = 0;
+}
+
+static void write_host_field(struct litevm_vcpu *vcpu, unsigned long field,
+			     unsigned long *cached, unsigned long value)
+{
+	if (vcpu->host_state.synced && *cached == value) {
+		++vcpu->stat->vmwrites_saved;
+		return;
+	}
+	vmcs_writel(field, value);
+	*cached = value;
+}
+
+/*
+ * Called before entry.  The host fs/gs state only changes when the thread
+ * goes back to userspace or moves to another cpu, both of which go
+ * through vcpu_put(), so it is read once per load and the vmcs is only
+ * written when a value actually differs from what it already holds.
+ */
+static void litevm_save_host_state(struct litevm_vcpu *vcpu)
+{
+	unsigned long fs_base = 0, gs_base = 0;
+	u16 fs_sel, gs_sel;
+
+	if (vcpu->host_state.loaded)
+		return;
+	vcpu->host_state.loaded = 1;
+
+	/*
+	 * Set host fs and gs selectors.  Unfortunately, 22.2.3 does not
+	 * allow segment selectors with cpl > 0 or ti == 1.
+	 */
+	fs_sel = vcpu->host_state.fs_sel = read_fs();
+	gs_sel = vcpu->host_state.gs_sel = read_gs();
+	vcpu->host_state.ldt_sel = read_ldt();
+	vcpu->host_state.fs_gs_ldt_reload_needed = (fs_sel & 7) | (gs_sel & 7)
+		| vcpu->host_state.ldt_sel;
+	if (vcpu->host_state.fs_gs_ldt_reload_needed)
+		fs_sel = gs_sel = 0;
+
+#ifdef __x86_64__
+	fs_base = read_msr(MSR_FS_BASE);
+	gs_base = read_msr(MSR_GS_BASE);
+#endif
+	vcpu->host_state.gs_base = gs_base;
+
+	write_host_field(vcpu, HOST_FS_SELECTOR,
+			 &vcpu->host_state.vmcs_fs_sel, fs_sel);
+	write_host_field(vcpu, HOST_GS_SELECTOR,
+			 &vcpu->host_state.vmcs_gs_sel, gs_sel);
+	write_host_field(vcpu, HOST_FS_BASE,
+			 &vcpu->host_state.vmcs_fs_base, fs_base);
+	write_host_field(vcpu, HOST_GS_BASE,
+			 &vcpu->host_state.vmcs_gs_base, gs_base);
+	vcpu->host_state.synced = 1;
+}
+
+/*
+ * The kernel does not need the user fs, gs and ldt, so they are put back
+ * only when leaving the vcpu rather than after every exit.
+ */
+static void litevm_load_host_state(struct litevm_vcpu *vcpu)
+{
+	unsigned long flags;
+
+	if (!vcpu->host_state.loaded)
+		return;
+	vcpu->host_state.loaded = 0;
+
+	if (!vcpu->host_state.fs_gs_ldt_reload_needed)
+		return;
+	load_ldt(vcpu->host_state.ldt_sel);
+	load_fs(vcpu->host_state.fs_sel);
+	/*
+	 * If we have to reload gs, we must take care to
+	 * preserve our gs base.
+	 */
+	local_irq_save(flags);
+	load_gs(vcpu->host_state.gs_sel);
+#ifdef __x86_64__
+	wrmsrl(MSR_GS_BASE, vcpu->host_state.gs_base);
+#endif
+	local_irq_restore(flags);
+
+	reload_tss();
+}
+
+const unsigned long litevm_vmcs_cached_field[NR_VCPU_VMCS_CACHED] = {
+	[VCPU_VMCS_RIP] = GUEST_RIP,
+	[VCPU_VMCS_RSP] = GUEST_RSP,
+	[VCPU_VMCS_RFLAGS] = GUEST_RFLAGS,
+	[VCPU_VMCS_CS_AR] = GUEST_CS_AR_BYTES,
+	[VCPU_VMCS_CR0] = GUEST_CR0,
+	[VCPU_VMCS_CR0_SHADOW] = CR0_READ_SHADOW,
+	[VCPU_VMCS_CR4] = GUEST_CR4,
+	[VCPU_VMCS_CR4_SHADOW] = CR4_READ_SHADOW,
+	[VCPU_VMCS_ENTRY_CONTROLS] = VM_ENTRY_CONTROLS,
+};
+
+/*
+ * Writes dirty cached fields back to the vmcs.  Must run before every
+ * entry and before the vcpu is put.
+ */
+static void vcpu_vmcs_flush(struct litevm_vcpu *vcpu)
+{
+	int i;
+
+	if (!vcpu->vmcs_cache_dirty)
+		return;
+	for (i = 0; i < NR_VCPU_VMCS_CACHED; ++i)
+		if (vcpu->vmcs_cache_dirty & (1u << i))
+			vmcs_writel(litevm_vmcs_cached_field[i],
+				    vcpu->vmcs_cache[i]);
+	vcpu->vmcs_cache_dirty = 0;
+}
 
+/*
+ * Gives the cpu back to the host: everything that was switched lazily
+ * while the vcpu ran.  The vmcs itself stays current.
+ */
+static void __vcpu_put(struct litevm_vcpu *vcpu)
+{
+	litevm_load_host_state(vcpu);
+	litevm_put_guest_msrs(vcpu);
+	litevm_put_guest_fpu(vcpu);
+}
+
+static void vcpu_put(struct litevm_vcpu *vcpu)
+{
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+	preempt_disable();
+#endif
+	__vcpu_put(vcpu);
+	vcpu_vmcs_flush(vcpu);
+	vcpu->vmcs_cache_avail = 0;
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+	preempt_notifier_unregister(&vcpu->preempt_notifier);
+#endif
+	put_cpu();
+	mutex_unlock(&vcpu->mutex);
+}
+
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+
+static struct litevm_vcpu *preempt_notifier_to_vcpu(struct preempt_notifier *pn)
+{
+	return container_of(pn, struct litevm_vcpu, preempt_notifier);
+}
+
+static void litevm_sched_in(struct preempt_notifier *pn, int cpu)
+{
+	struct litevm_vcpu *vcpu = preempt_notifier_to_vcpu(pn);
+
+	vcpu->preempted = 0;
+	vcpu_load_cpu(vcpu, cpu);
+}
+
+/*
+ * The vcpu thread is leaving the cpu: restore host msrs, fpu and segments
+ * now rather than on every exit.  The vmcs is only cleared if the thread
+ * later comes back in on a different cpu.
+ */
+static void litevm_sched_out(struct preempt_notifier *pn,
+			     struct task_struct *next)
+{
+	struct litevm_vcpu *vcpu = preempt_notifier_to_vcpu(pn);
+
+	if (current->state == TASK_RUNNING)
+		vcpu->preempted = 1;
+	__vcpu_put(vcpu);
+}
+
+static struct preempt_ops litevm_preempt_ops = {
+	.sched_in = litevm_sched_in,
+	.sched_out = litevm_sched_out,
+};
+
+#endif
+
+
+static struct vmcs *alloc_vmcs_cpu(int cpu)
+{
+	int node = cpu_to_node(cpu);
+	struct page *pages;
+	struct vmcs *vmcs;
+
+	pages = alloc_pages_node(node, GFP_KERNEL, vmcs_descriptor.order);
+	if (!pages)
+		return 0;
+	vmcs = page_address(pages);
+	memset(vmcs, 0, vmcs_descriptor.size);
+	vmcs->revision_id = vmcs_descriptor.revision_id; /* vmcs revision id */
+	return vmcs;
+}
+
+static struct vmcs *alloc_vmcs(void)
+{
+	return alloc_vmcs_cpu(smp_processor_id());
+}
+
+static void free_vmcs(struct vmcs *vmcs)
+{
+	free_pages((unsigned long)vmcs, vmcs_descriptor.order);
+}
+
+static __init int cpu_has_litevm_support(void)
+{
+	unsigned long ecx = cpuid_ecx(1);
+	return test_bit(5, &ecx); /* CPUID.1:ECX.VMX[bit 5] -> VT */
+}
+
+static void free_litevm_area(void)
+{
+	int cpu;
+
+	for_each_online_cpu(cpu)
+		free_vmcs(per_cpu(vmxarea, cpu));
+}
+
+static __init int alloc_litevm_area(void)
+{
+	int cpu;
+
+	for_each_online_cpu(cpu) {
+		struct vmcs *vmcs;
+
+		INIT_LIST_HEAD(&per_cpu(loaded_vmcss_on_cpu, cpu));
 		vmcs = alloc_vmcs_cpu(cpu);
 		if (!vmcs) {
 			free_litevm_area();
@@ -538,9 +1266,340 @@ static __init void litevm_enable(void *garbage)
 
 static void litevm_disable(void *garbage)
 {
+	int cpu = raw_smp_processor_id();
+	struct litevm_vcpu *vcpu, *n;
+
+	/* vmxoff leaves active vmcss in an undefined state */
+	list_for_each_entry_safe(vcpu, n, &per_cpu(loaded_vmcss_on_cpu, cpu),
+				 local_vcpus_link)
+		__vcpu_clear(vcpu);
 	asm volatile ("vmxoff" : : : "cc");
 }
 
+static void hist_add(u64 *hist, u64 cycles)
+{
+	int bucket = fls64(cycles);
+
+	if (bucket >= LITEVM_HIST_BUCKETS)
+		bucket = LITEVM_HIST_BUCKETS - 1;
+	++hist[bucket];
+}
+
+static void account_exit(struct litevm_vcpu *vcpu, u32 exit_reason,
+			 u64 cycles)
+{
+	struct litevm_exit_stats *stats = vcpu->exit_stats;
+	u32 i = exit_reason & 0xffff;
+
+	if (i >= LITEVM_NR_EXIT_STATS)
+		i = LITEVM_NR_EXIT_STATS - 1;
+	++stats->count[i];
+	hist_add(stats->handler[i], cycles);
+}
+
+static void note_user_exit(struct litevm_vcpu *vcpu,
+			   struct litevm_run *litevm_run)
+{
+	if (litevm_run->exit_type != LITEVM_EXIT_TYPE_VM_EXIT)
+		return;
+	vcpu->user_exit_reason = litevm_run->exit_reason;
+	rdtscll(vcpu->user_exit_tsc);
+}
+
+static void account_user_exit(struct litevm_vcpu *vcpu)
+{
+	struct litevm_exit_stats *stats = vcpu->exit_stats;
+	u32 i = vcpu->user_exit_reason;
+	u64 now;
+
+	if (i >= LITEVM_NR_USER_EXITS)
+		i = LITEVM_NR_USER_EXITS - 1;
+	rdtscll(now);
+	hist_add(stats->user[i], now - vcpu->user_exit_tsc);
+	vcpu->user_exit_tsc = 0;
+}
+
+static void seq_print_hist(struct seq_file *m, const u64 *hist)
+{
+	int n = LITEVM_HIST_BUCKETS;
+	int i;
+
+	while (n && !hist[n - 1])
+		--n;
+	for (i = 0; i < n; ++i)
+		seq_printf(m, " %llu", (unsigned long long)hist[i]);
+	seq_puts(m, "\n");
+}
+
+static void sum_exit_stats(struct litevm_exit_stats *sum,
+			   struct litevm_exit_stats *stats)
+{
+	u64 *to = (u64 *)sum;
+	u64 *from = (u64 *)stats;
+	int i;
+
+	for (i = 0; i < sizeof *sum / sizeof(u64); ++i)
+		to[i] += from[i];
+}
+
+static int exit_stats_show(struct seq_file *m, void *v)
+{
+	struct litevm *litevm = m->private;
+	struct litevm_exit_stats *stats;
+	int i, j;
+
+	stats = vzalloc(sizeof *stats);
+	if (!stats)
+		return -ENOMEM;
+	for (i = 0; i < LITEVM_MAX_VCPUS; ++i)
+		if (litevm->vcpus[i].exit_stats)
+			sum_exit_stats(stats, litevm->vcpus[i].exit_stats);
+
+	seq_puts(m, "# vmx exit reason, count, handler cycles by log2 bucket\n");
+	for (i = 0; i < LITEVM_NR_EXIT_STATS; ++i) {
+		if (!stats->count[i])
+			continue;
+		seq_printf(m, "%d %llu", i, (unsigned long long)stats->count[i]);
+		seq_print_hist(m, stats->handler[i]);
+	}
+	seq_puts(m, "# litevm exit reason, userspace cycles by log2 bucket\n");
+	for (i = 0; i < LITEVM_NR_USER_EXITS; ++i) {
+		for (j = 0; j < LITEVM_HIST_BUCKETS; ++j)
+			if (stats->user[i][j])
+				break;
+		if (j == LITEVM_HIST_BUCKETS)
+			continue;
+		seq_printf(m, "%d", i);
+		seq_print_hist(m, stats->user[i]);
+	}
+	vfree(stats);
+	return 0;
+}
+
+static void litevm_put(struct litevm *litevm);
+
+/*
+ * An open file in a vm's debugfs directory holds a reference, so a read
+ * can't outlive the vm.  The vm is found on vm_list, which it leaves
+ * before dropping the reference its fd holds.
+ */
+static struct litevm *litevm_get_debugfs(struct inode *inode)
+{
+	struct litevm *litevm;
+
+	spin_lock(&vm_list_lock);
+	list_for_each_entry(litevm, &vm_list, vm_list)
+		if (litevm == inode->i_private) {
+			atomic_inc(&litevm->users);
+			spin_unlock(&vm_list_lock);
+			return litevm;
+		}
+	spin_unlock(&vm_list_lock);
+	return 0;
+}
+
+static int vm_debugfs_single_open(struct inode *inode, struct file *file,
+				  int (*show)(struct seq_file *, void *))
+{
+	struct litevm *litevm = litevm_get_debugfs(inode);
+	int r;
+
+	if (!litevm)
+		return -ENOENT;
+	r = single_open(file, show, litevm);
+	if (r)
+		litevm_put(litevm);
+	return r;
+}
+
+static int vm_debugfs_single_release(struct inode *inode, struct file *file)
+{
+	struct litevm *litevm = ((struct seq_file *)file->private_data)->private;
+	int r;
+
+	r = single_release(inode, file);
+	litevm_put(litevm);
+	return r;
+}
+
+static int exit_stats_open(struct inode *inode, struct file *file)
+{
+	return vm_debugfs_single_open(inode, file, exit_stats_show);
+}
+
+static struct file_operations exit_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = exit_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = vm_debugfs_single_release,
+};
+
+static u64 vcpu_stat(struct litevm_vcpu *vcpu,
+		     struct litevm_stats_debugfs_item *p)
+{
+	return *(u64 *)((char *)vcpu->stat + p->offset);
+}
+
+static u64 combine_stat(struct litevm_stats_debugfs_item *p, u64 a, u64 b)
+{
+	if (p->max)
+		return a > b ? a : b;
+	return a + b;
+}
+
+static u64 vm_stat(struct litevm *litevm, struct litevm_stats_debugfs_item *p)
+{
+	u64 r = 0;
+	int i;
+
+	for (i = 0; i < LITEVM_MAX_VCPUS; ++i)
+		r = combine_stat(p, r, vcpu_stat(&litevm->vcpus[i], p));
+	return r;
+}
+
+/* the top level files: every vm there is */
+static int global_stat_get(void *data, u64 *val)
+{
+	struct litevm_stats_debugfs_item *p = data;
+	struct litevm *litevm;
+
+	*val = 0;
+	spin_lock(&vm_list_lock);
+	list_for_each_entry(litevm, &vm_list, vm_list)
+		*val = combine_stat(p, *val, vm_stat(litevm, p));
+	spin_unlock(&vm_list_lock);
+	return 0;
+}
+
+DEFINE_SIMPLE_ATTRIBUTE(global_stat_fops, global_stat_get, NULL, "%llu\n");
+
+static int vm_stats_show(struct seq_file *m, void *v)
+{
+	struct litevm *litevm = m->private;
+	struct litevm_stats_debugfs_item *p;
+
+	for (p = debugfs_entries; p->name; ++p)
+		seq_printf(m, "%s %llu\n", p->name,
+			   (unsigned long long)vm_stat(litevm, p));
+	return 0;
+}
+
+static int vm_stats_open(struct inode *inode, struct file *file)
+{
+	return vm_debugfs_single_open(inode, file, vm_stats_show);
+}
+
+static struct file_operations vm_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = vm_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = vm_debugfs_single_release,
+};
+
+#define STATS_NDESC (ARRAY_SIZE(debugfs_entries) - 1)
+#define STATS_DATA_OFFSET ALIGN(sizeof(struct litevm_stats_header)	\
+				+ STATS_NDESC * sizeof(struct litevm_stat_desc), \
+				L1_CACHE_BYTES)
+
+/*
+ * Lay out the page described in linux/litevm.h and point each vcpu at
+ * its block of counters.
+ */
+static int alloc_stats_page(struct litevm *litevm)
+{
+	struct litevm_stats_header *hdr;
+	struct litevm_stat_desc *desc;
+	int i;
+
+	BUILD_BUG_ON(STATS_DATA_OFFSET + LITEVM_MAX_VCPUS
+		     * sizeof(struct litevm_vcpu_stat) > PAGE_SIZE);
+
+	hdr = (void *)get_zeroed_page(GFP_KERNEL);
+	if (!hdr)
+		return -ENOMEM;
+	hdr->magic = LITEVM_STATS_MAGIC;
+	hdr->version = LITEVM_STATS_VERSION;
+	hdr->size = STATS_DATA_OFFSET
+		+ LITEVM_MAX_VCPUS * sizeof(struct litevm_vcpu_stat);
+	hdr->ndesc = STATS_NDESC;
+	hdr->desc_offset = sizeof *hdr;
+	hdr->data_offset = STATS_DATA_OFFSET;
+	hdr->vcpu_stride = sizeof(struct litevm_vcpu_stat);
+	hdr->nvcpus = LITEVM_MAX_VCPUS;
+
+	desc = (void *)hdr + hdr->desc_offset;
+	for (i = 0; i < STATS_NDESC; ++i) {
+		strlcpy(desc[i].name, debugfs_entries[i].name,
+			sizeof desc[i].name);
+		desc[i].offset = debugfs_entries[i].offset;
+		desc[i].flags = debugfs_entries[i].max ? LITEVM_STAT_MAX : 0;
+	}
+
+	for (i = 0; i < LITEVM_MAX_VCPUS; ++i)
+		litevm->vcpus[i].stat = (void *)hdr + hdr->data_offset
+			+ i * hdr->vcpu_stride;
+	litevm->stats_page = hdr;
+	return 0;
+}
+
+/* litevm/<vm>/stats_page: the same bytes as the mmap, for read() */
+static int stats_page_open(struct inode *inode, struct file *file)
+{
+	struct litevm *litevm = litevm_get_debugfs(inode);
+
+	if (!litevm)
+		return -ENOENT;
+	file->private_data = litevm;
+	return 0;
+}
+
+static ssize_t stats_page_read(struct file *file, char __user *buf,
+			       size_t len, loff_t *ppos)
+{
+	struct litevm *litevm = file->private_data;
+	struct litevm_stats_header *hdr = litevm->stats_page;
+
+	return simple_read_from_buffer(buf, len, ppos, hdr, hdr->size);
+}
+
+static int stats_page_release(struct inode *inode, struct file *file)
+{
+	litevm_put(file->private_data);
+	return 0;
+}
+
+static struct file_operations stats_page_fops = {
+	.owner = THIS_MODULE,
+	.open = stats_page_open,
+	.read = stats_page_read,
+	.llseek = default_llseek,
+	.release = stats_page_release,
+};
+
+/*
+ * litevm/<pid>-<n>: one directory per open of /dev/litevm.  Statistics
+ * are a debugging aid, so a vm without them still runs.
+ */
+static void litevm_create_vm_debugfs(struct litevm *litevm)
+{
+	static atomic_t vm_seq;
+	char name[32];
+
+	snprintf(name, sizeof name, "%d-%d", task_pid_nr(current),
+		 atomic_inc_return(&vm_seq));
+	litevm->debugfs_dir = debugfs_create_dir(name, debugfs_dir);
+	if (!litevm->debugfs_dir)
+		return;
+	debugfs_create_file("stats", 0444, litevm->debugfs_dir, litevm,
+			    &vm_stats_fops);
+	debugfs_create_file("exit_stats", 0444, litevm->debugfs_dir, litevm,
+			    &exit_stats_fops);
+	debugfs_create_file("stats_page", 0444, litevm->debugfs_dir, litevm,
+			    &stats_page_fops);
+}
+
 static int litevm_dev_open(struct inode *inode, struct file *filp)
 {
 	struct litevm *litevm = kzalloc(sizeof(struct litevm), GFP_KERNEL);
@@ -549,17 +1608,38 @@ static int litevm_dev_open(struct inode *inode, struct file *filp)
 	if (!litevm)
 		return -ENOMEM;
 
+	atomic_set(&litevm->users, 1);
 	spin_lock_init(&litevm->lock);
 	INIT_LIST_HEAD(&litevm->active_mmu_pages);
+	litevm->ept = vmx_has_ept;
 	for (i = 0; i < LITEVM_MAX_VCPUS; ++i) {
 		struct litevm_vcpu *vcpu = &litevm->vcpus[i];
 
 		mutex_init(&vcpu->mutex);
+		init_waitqueue_head(&vcpu->wq);
 		vcpu->mmu.root_hpa = INVALID_PAGE;
 		INIT_LIST_HEAD(&vcpu->free_pages);
 	}
+	if (alloc_msr_bitmap(litevm))
+		goto out_free;
+	if (alloc_io_bitmaps(litevm))
+		goto out_free_msr_bitmap;
+	if (alloc_stats_page(litevm))
+		goto out_free_io_bitmaps;
+	spin_lock(&vm_list_lock);
+	list_add(&litevm->vm_list, &vm_list);
+	spin_unlock(&vm_list_lock);
+	litevm_create_vm_debugfs(litevm);
 	filp->private_data = litevm;
 	return 0;
+
+out_free_io_bitmaps:
+	free_io_bitmaps(litevm);
+out_free_msr_bitmap:
+	free_page((unsigned long)litevm->msr_bitmap);
+out_free:
+	kfree(litevm);
+	return -ENOMEM;
 }
 
 /*
@@ -596,16 +1676,94 @@ static void litevm_free_physmem(struct litevm *litevm)
 static void litevm_free_vmcs(struct litevm_vcpu *vcpu)
 {
 	if (vcpu->vmcs) {
-		on_each_cpu(__vcpu_clear, vcpu, 1);
+		vcpu_clear(vcpu);
 		free_vmcs(vcpu->vmcs);
 		vcpu->vmcs = 0;
 	}
 }
 
+static int litevm_ring_init(struct litevm_ring *ring, u32 record_size)
+{
+	struct litevm_ring_header *hdr;
+
+	hdr = vmalloc_user(LITEVM_RING_PAGES * PAGE_SIZE);
+	if (!hdr)
+		return -ENOMEM;
+	ring->head = 0;
+	ring->record_size = record_size;
+	ring->size = (LITEVM_RING_PAGES * PAGE_SIZE - L1_CACHE_BYTES)
+		/ record_size;
+	hdr->size = ring->size;
+	hdr->record_size = record_size;
+	hdr->data_offset = L1_CACHE_BYTES;
+	smp_wmb();	/* litevm_ring_page() looks without the vcpu mutex */
+	ring->hdr = hdr;
+	return 0;
+}
+
+static void litevm_ring_free(struct litevm_ring *ring)
+{
+	vfree(ring->hdr);
+	ring->hdr = 0;
+}
+
+/*
+ * Room for the next record, or 0 if userspace has let the ring fill up.
+ */
+static void *litevm_ring_reserve(struct litevm_ring *ring)
+{
+	struct litevm_ring_header *hdr = ring->hdr;
+	u32 next = ring->head + 1 == ring->size ? 0 : ring->head + 1;
+
+	if (next == ACCESS_ONCE(hdr->tail)) {
+		++hdr->lost;
+		return 0;
+	}
+	return (void *)hdr + L1_CACHE_BYTES + ring->head * ring->record_size;
+}
+
+static void litevm_ring_commit(struct litevm_ring *ring)
+{
+	ring->head = ring->head + 1 == ring->size ? 0 : ring->head + 1;
+	smp_wmb();	/* the record before the head that covers it */
+	ring->hdr->head = ring->head;
+}
+
+static struct page *litevm_ring_page(struct litevm_ring *ring,
+				     unsigned long n)
+{
+	struct litevm_ring_header *hdr = ACCESS_ONCE(ring->hdr);
+
+	if (!hdr || n >= LITEVM_RING_PAGES)
+		return NULL;
+	smp_rmb();	/* pairs with litevm_ring_init() */
+	return vmalloc_to_page((void *)hdr + n * PAGE_SIZE);
+}
+
 static void litevm_free_vcpu(struct litevm_vcpu *vcpu)
 {
 	litevm_free_vmcs(vcpu);
+	free_vpid(vcpu);
 	litevm_mmu_destroy(vcpu);
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+	put_pid(vcpu->pid);
+	vcpu->pid = 0;
+#endif
+	vfree(vcpu->exit_stats);
+	vcpu->exit_stats = 0;
+	litevm_ring_free(&vcpu->sample_ring);
+	litevm_ring_free(&vcpu->exit_ring);
+	litevm_ring_free(&vcpu->replay_ring);
+	vfree(vcpu->replay);
+	vcpu->replay = 0;
+	if (vcpu->vapic) {
+		free_page((unsigned long)vcpu->vapic);
+		vcpu->vapic = 0;
+	}
+	if (vcpu->run) {
+		free_page((unsigned long)vcpu->run);
+		vcpu->run = 0;
+	}
 }
 
 static void litevm_free_vcpus(struct litevm *litevm)
@@ -616,13 +1774,32 @@ static void litevm_free_vcpus(struct litevm *litevm)
 		litevm_free_vcpu(&litevm->vcpus[i]);
 }
 
-static int litevm_dev_release(struct inode *inode, struct file *filp)
+static void litevm_destroy(struct litevm *litevm)
 {
-	struct litevm *litevm = filp->private_data;
-
 	litevm_free_vcpus(litevm);
 	litevm_free_physmem(litevm);
+	free_page((unsigned long)litevm->msr_bitmap);
+	free_io_bitmaps(litevm);
+	free_page((unsigned long)litevm->stats_page);
 	kfree(litevm);
+}
+
+static void litevm_put(struct litevm *litevm)
+{
+	if (atomic_dec_and_test(&litevm->users))
+		litevm_destroy(litevm);
+}
+
+static int litevm_dev_release(struct inode *inode, struct file *filp)
+{
+	struct litevm *litevm = filp->private_data;
+
+	/* no new debugfs opens; the ones still open keep the vm */
+	debugfs_remove_recursive(litevm->debugfs_dir);
+	spin_lock(&vm_list_lock);
+	list_del(&litevm->vm_list);
+	spin_unlock(&vm_list_lock);
+	litevm_put(litevm);
 	return 0;
 }
 
@@ -650,21 +1827,10 @@ static void vmcs_write16(unsigned long field, u16 value)
 	vmcs_writel(field, value);
 }
 
-static void vmcs_write64(unsigned long field, u64 value)
-{
-#ifdef __x86_64__
-	vmcs_writel(field, value);
-#else
-	vmcs_writel(field, value);
-	asm volatile ("");
-	vmcs_writel(field+1, value >> 32);
-#endif
-}
-
 static void inject_gp(struct litevm_vcpu *vcpu)
 {
 	printk(KERN_DEBUG "inject_general_protection: rip 0x%lx\n",
-	       vmcs_readl(GUEST_RIP));
+	       vcpu_vmcs_readl(vcpu, VCPU_VMCS_RIP));
 	vmcs_write32(VM_ENTRY_EXCEPTION_ERROR_CODE, 0);
 	vmcs_write32(VM_ENTRY_INTR_INFO_FIELD,
 		     GP_VECTOR |
@@ -673,14 +1839,6 @@ static void inject_gp(struct litevm_vcpu *vcpu)
 		     INTR_INFO_VALID_MASK);
 }
 
-static void update_exception_bitmap(struct litevm_vcpu *vcpu)
-{
-	if (vcpu->rmode.active)
-		vmcs_write32(EXCEPTION_BITMAP, ~0);
-	else
-		vmcs_write32(EXCEPTION_BITMAP, 1 << PF_VECTOR);
-}
-
 static void enter_pmode(struct litevm_vcpu *vcpu)
 {
 	unsigned long flags;
@@ -691,13 +1849,13 @@ static void enter_pmode(struct litevm_vcpu *vcpu)
 	vmcs_write32(GUEST_TR_LIMIT, vcpu->rmode.tr.limit);
 	vmcs_write32(GUEST_TR_AR_BYTES, vcpu->rmode.tr.ar);
 
-	flags = vmcs_readl(GUEST_RFLAGS);
+	flags = vcpu_vmcs_readl(vcpu, VCPU_VMCS_RFLAGS);
 	flags &= ~(X86_EFLAGS_IOPL | X86_EFLAGS_VM);
 	flags |= (vcpu->rmode.save_iopl << IOPL_SHIFT);
-	vmcs_writel(GUEST_RFLAGS, flags);
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_RFLAGS, flags);
 
-	vmcs_writel(GUEST_CR4, (vmcs_readl(GUEST_CR4) & ~CR4_VME_MASK) |
-			(vmcs_readl(CR0_READ_SHADOW) & CR4_VME_MASK) );
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_CR4, (vcpu_vmcs_readl(vcpu, VCPU_VMCS_CR4) & ~CR4_VME_MASK) |
+			(vcpu_vmcs_readl(vcpu, VCPU_VMCS_CR0_SHADOW) & CR4_VME_MASK) );
 
 	update_exception_bitmap(vcpu);
 
@@ -716,7 +1874,7 @@ static void enter_pmode(struct litevm_vcpu *vcpu)
 
 	vmcs_write16(GUEST_CS_SELECTOR,
 		     vmcs_read16(GUEST_CS_SELECTOR) & ~SELECTOR_RPL_MASK);
-	vmcs_write32(GUEST_CS_AR_BYTES, 0x9b);
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_CS_AR, 0x9b);
 }
 
 static int rmode_tss_base(struct litevm* litevm)
@@ -740,13 +1898,13 @@ static void enter_rmode(struct litevm_vcpu *vcpu)
 	vcpu->rmode.tr.ar = vmcs_read32(GUEST_TR_AR_BYTES);
 	vmcs_write32(GUEST_TR_AR_BYTES, 0x008b);
 
-	flags = vmcs_readl(GUEST_RFLAGS);
+	flags = vcpu_vmcs_readl(vcpu, VCPU_VMCS_RFLAGS);
 	vcpu->rmode.save_iopl = (flags & X86_EFLAGS_IOPL) >> IOPL_SHIFT;
 
 	flags |= X86_EFLAGS_IOPL | X86_EFLAGS_VM;
 
-	vmcs_writel(GUEST_RFLAGS, flags);
-	vmcs_writel(GUEST_CR4, vmcs_readl(GUEST_CR4) | CR4_VME_MASK);
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_RFLAGS, flags);
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_CR4, vcpu_vmcs_readl(vcpu, VCPU_VMCS_CR4) | CR4_VME_MASK);
 	update_exception_bitmap(vcpu);
 
 	#define FIX_RMODE_SEG(seg, save) {				   \
@@ -756,7 +1914,7 @@ static void enter_rmode(struct litevm_vcpu *vcpu)
 		vmcs_write32(GUEST_##seg##_AR_BYTES, 0xf3);		   \
 	}
 
-	vmcs_write32(GUEST_CS_AR_BYTES, 0xf3);
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_CS_AR, 0xf3);
 	vmcs_write16(GUEST_CS_SELECTOR, vmcs_readl(GUEST_CS_BASE) >> 4);
 
 	FIX_RMODE_SEG(ES, vcpu->rmode.es);
@@ -806,14 +1964,14 @@ static void __set_efer(struct litevm_vcpu *vcpu, u64 efer)
 
 	vcpu->shadow_efer = efer;
 	if (efer & EFER_LMA) {
-		vmcs_write32(VM_ENTRY_CONTROLS,
-				     vmcs_read32(VM_ENTRY_CONTROLS) |
+		vcpu_vmcs_writel(vcpu, VCPU_VMCS_ENTRY_CONTROLS,
+				     vcpu_vmcs_readl(vcpu, VCPU_VMCS_ENTRY_CONTROLS) |
 				     VM_ENTRY_CONTROLS_IA32E_MASK);
 		msr->data = efer;
 
 	} else {
-		vmcs_write32(VM_ENTRY_CONTROLS,
-				     vmcs_read32(VM_ENTRY_CONTROLS) &
+		vcpu_vmcs_writel(vcpu, VCPU_VMCS_ENTRY_CONTROLS,
+				     vcpu_vmcs_readl(vcpu, VCPU_VMCS_ENTRY_CONTROLS) &
 				     ~VM_ENTRY_CONTROLS_IA32E_MASK);
 
 		msr->data = efer & ~EFER_LME;
@@ -836,8 +1994,8 @@ static void enter_lmode(struct litevm_vcpu *vcpu)
 	vcpu->shadow_efer |= EFER_LMA;
 
 	find_msr_entry(vcpu, MSR_EFER)->data |= EFER_LMA | EFER_LME;
-	vmcs_write32(VM_ENTRY_CONTROLS,
-		     vmcs_read32(VM_ENTRY_CONTROLS)
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_ENTRY_CONTROLS,
+		     vcpu_vmcs_readl(vcpu, VCPU_VMCS_ENTRY_CONTROLS)
 		     | VM_ENTRY_CONTROLS_IA32E_MASK);
 }
 
@@ -845,8 +2003,8 @@ static void exit_lmode(struct litevm_vcpu *vcpu)
 {
 	vcpu->shadow_efer &= ~EFER_LMA;
 
-	vmcs_write32(VM_ENTRY_CONTROLS,
-		     vmcs_read32(VM_ENTRY_CONTROLS)
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_ENTRY_CONTROLS,
+		     vcpu_vmcs_readl(vcpu, VCPU_VMCS_ENTRY_CONTROLS)
 		     & ~VM_ENTRY_CONTROLS_IA32E_MASK);
 }
 
@@ -862,15 +2020,14 @@ static void __set_cr0(struct litevm_vcpu *vcpu, unsigned long cr0)
 
 #ifdef __x86_64__
 	if (vcpu->shadow_efer & EFER_LME) {
-		if (!is_paging() && (cr0 & CR0_PG_MASK))
+		if (!is_paging(vcpu) && (cr0 & CR0_PG_MASK))
 			enter_lmode(vcpu);
-		if (is_paging() && !(cr0 & CR0_PG_MASK))
+		if (is_paging(vcpu) && !(cr0 & CR0_PG_MASK))
 			exit_lmode(vcpu);
 	}
 #endif
 
-	vmcs_writel(CR0_READ_SHADOW, cr0);
-	vmcs_writel(GUEST_CR0, cr0 | LITEVM_VM_CR0_ALWAYS_ON);
+	set_guest_cr0(vcpu, cr0);
 }
 
 static int pdptrs_have_reserved_bits_set(struct litevm_vcpu *vcpu,
@@ -902,9 +2059,11 @@ static int pdptrs_have_reserved_bits_set(struct litevm_vcpu *vcpu,
 
 static void set_cr0(struct litevm_vcpu *vcpu, unsigned long cr0)
 {
+	unsigned long old_cr0 = guest_cr0(vcpu);
+
 	if (cr0 & CR0_RESEVED_BITS) {
 		printk(KERN_DEBUG "set_cr0: 0x%lx #GP, reserved bits 0x%lx\n",
-		       cr0, guest_cr0());
+		       cr0, guest_cr0(vcpu));
 		inject_gp(vcpu);
 		return;
 	}
@@ -922,17 +2081,17 @@ static void set_cr0(struct litevm_vcpu *vcpu, unsigned long cr0)
 		return;
 	}
 
-	if (!is_paging() && (cr0 & CR0_PG_MASK)) {
+	if (!is_paging(vcpu) && (cr0 & CR0_PG_MASK)) {
 #ifdef __x86_64__
 		if ((vcpu->shadow_efer & EFER_LME)) {
 			u32 guest_cs_ar;
-			if (!is_pae()) {
+			if (!is_pae(vcpu)) {
 				printk(KERN_DEBUG "set_cr0: #GP, start paging "
 				       "in long mode while PAE is disabled\n");
 				inject_gp(vcpu);
 				return;
 			}
-			guest_cs_ar = vmcs_read32(GUEST_CS_AR_BYTES);
+			guest_cs_ar = vcpu_vmcs_readl(vcpu, VCPU_VMCS_CS_AR);
 			if (guest_cs_ar & SEGMENT_AR_L_MASK) {
 				printk(KERN_DEBUG "set_cr0: #GP, start paging "
 				       "in long mode while CS.L == 1\n");
@@ -942,7 +2101,7 @@ static void set_cr0(struct litevm_vcpu *vcpu, unsigned long cr0)
 			}
 		} else
 #endif
-		if (is_pae() &&
+		if (is_pae(vcpu) &&
 			    pdptrs_have_reserved_bits_set(vcpu, vcpu->cr3)) {
 			printk(KERN_DEBUG "set_cr0: #GP, pdptrs "
 			       "reserved bits\n");
@@ -953,30 +2112,30 @@ static void set_cr0(struct litevm_vcpu *vcpu, unsigned long cr0)
 	}
 
 	__set_cr0(vcpu, cr0);
-	litevm_mmu_reset_context(vcpu);
+	/* Guests flip TS all the time; only paging changes need a new mmu. */
+	if ((old_cr0 ^ cr0) & (CR0_PG_MASK | CR0_PE_MASK | CR0_WP_MASK))
+		litevm_mmu_mode_changed(vcpu);
 	return;
 }
 
 static void lmsw(struct litevm_vcpu *vcpu, unsigned long msw)
 {
-	unsigned long cr0 = guest_cr0();
+	unsigned long cr0 = guest_cr0(vcpu);
 
+	/* lmsw can set PE but never clear it */
 	if ((msw & CR0_PE_MASK) && !(cr0 & CR0_PE_MASK)) {
 		enter_pmode(vcpu);
-		vmcs_writel(CR0_READ_SHADOW, cr0 | CR0_PE_MASK);
-
-	} else
-		printk(KERN_DEBUG "lmsw: unexpected\n");
-
-	vmcs_writel(GUEST_CR0, (vmcs_readl(GUEST_CR0) & ~LMSW_GUEST_MASK)
-				| (msw & LMSW_GUEST_MASK));
+		cr0 |= CR0_PE_MASK;
+	}
+	set_guest_cr0(vcpu, (cr0 & ~LMSW_GUEST_MASK) | (msw & LMSW_GUEST_MASK));
 }
 
 static void __set_cr4(struct litevm_vcpu *vcpu, unsigned long cr4)
 {
-	vmcs_writel(CR4_READ_SHADOW, cr4);
-	vmcs_writel(GUEST_CR4, cr4 | (vcpu->rmode.active ?
-		    LITEVM_RMODE_VM_CR4_ALWAYS_ON : LITEVM_PMODE_VM_CR4_ALWAYS_ON));
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_CR4_SHADOW, cr4);
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_CR4, cr4 | (vcpu->rmode.active ?
+		    LITEVM_RMODE_VM_CR4_ALWAYS_ON : vcpu->mmu.ept ?
+		    LITEVM_EPT_CR4_ALWAYS_ON : LITEVM_PMODE_VM_CR4_ALWAYS_ON));
 }
 
 static void set_cr4(struct litevm_vcpu *vcpu, unsigned long cr4)
@@ -987,14 +2146,14 @@ static void set_cr4(struct litevm_vcpu *vcpu, unsigned long cr4)
 		return;
 	}
 
-	if (is_long_mode()) {
+	if (is_long_mode(vcpu)) {
 		if (!(cr4 & CR4_PAE_MASK)) {
 			printk(KERN_DEBUG "set_cr4: #GP, clearing PAE while "
 			       "in long mode\n");
 			inject_gp(vcpu);
 			return;
 		}
-	} else if (is_paging() && !is_pae() && (cr4 & CR4_PAE_MASK)
+	} else if (is_paging(vcpu) && !is_pae(vcpu) && (cr4 & CR4_PAE_MASK)
 		   && pdptrs_have_reserved_bits_set(vcpu, vcpu->cr3)) {
 		printk(KERN_DEBUG "set_cr4: #GP, pdptrs reserved bits\n");
 		inject_gp(vcpu);
@@ -1007,13 +2166,13 @@ static void set_cr4(struct litevm_vcpu *vcpu, unsigned long cr4)
 	}
 	__set_cr4(vcpu, cr4);
 	spin_lock(&vcpu->litevm->lock);
-	litevm_mmu_reset_context(vcpu);
+	litevm_mmu_mode_changed(vcpu);
 	spin_unlock(&vcpu->litevm->lock);
 }
 
 static void set_cr3(struct litevm_vcpu *vcpu, unsigned long cr3)
 {
-	if (is_long_mode()) {
+	if (is_long_mode(vcpu)) {
 		if ( cr3 & CR3_L_MODE_RESEVED_BITS) {
 			printk(KERN_DEBUG "set_cr3: #GP, reserved bits\n");
 			inject_gp(vcpu);
@@ -1025,7 +2184,7 @@ static void set_cr3(struct litevm_vcpu *vcpu, unsigned long cr3)
 			inject_gp(vcpu);
 			return;
 		}
-		if (is_paging() && is_pae() &&
+		if (is_paging(vcpu) && is_pae(vcpu) &&
 		    pdptrs_have_reserved_bits_set(vcpu, cr3)) {
 			printk(KERN_DEBUG "set_cr3: #GP, pdptrs "
 			       "reserved bits\n");
@@ -1040,6 +2199,13 @@ static void set_cr3(struct litevm_vcpu *vcpu, unsigned long cr3)
 	spin_unlock(&vcpu->litevm->lock);
 }
 
+static void __set_cr8(struct litevm_vcpu *vcpu, unsigned long cr8)
+{
+	vcpu->cr8 = cr8;
+	if (vcpu->vapic)
+		vcpu->vapic[VAPIC_TPR] = cr8 << 4;
+}
+
 static void set_cr8(struct litevm_vcpu *vcpu, unsigned long cr8)
 {
 	if ( cr8 & CR8_RESEVED_BITS) {
@@ -1047,7 +2213,7 @@ static void set_cr8(struct litevm_vcpu *vcpu, unsigned long cr8)
 		inject_gp(vcpu);
 		return;
 	}
-	vcpu->cr8 = cr8;
+	__set_cr8(vcpu, cr8);
 }
 
 static u32 get_rdx_init_val(void)
@@ -1074,10 +2240,12 @@ static void fx_init(struct litevm_vcpu *vcpu)
 
 	} *fx_image;
 
+	preempt_disable();
 	fx_save(vcpu->host_fx_image);
 	fpu_init();
 	fx_save(vcpu->guest_fx_image);
 	fx_restore(vcpu->host_fx_image);
+	preempt_enable();
 
 	fx_image = (struct fx_image_s *)vcpu->guest_fx_image;
 	fx_image->mxcsr = 0x1f80;
@@ -1096,6 +2264,38 @@ static void vmcs_write32_fixedbits(u32 msr, u32 vmcs_field, u32 val)
 	vmcs_write32(vmcs_field, val);
 }
 
+/*
+ * Called by the mmu when it switches between an ept context and a shadow
+ * one.  With ept the guest owns cr3, invlpg, #PF and the paging bits of
+ * cr0 and cr4 that the shadow pager has to force.
+ */
+void litevm_set_ept(struct litevm_vcpu *vcpu, int enable)
+{
+	u32 shadow_exits = CPU_BASED_CR3_LOAD_EXITING
+		| CPU_BASED_CR3_STORE_EXITING
+		| CPU_BASED_INVDPG_EXITING;
+	u32 cpu_based = vmcs_read32(CPU_BASED_VM_EXEC_CONTROL);
+	u32 secondary = vmcs_read32(SECONDARY_VM_EXEC_CONTROL);
+
+	vcpu->mmu.ept = enable;
+	if (enable) {
+		vmcs_write64(EPT_POINTER, construct_eptp(vcpu->mmu.root_hpa));
+		cpu_based &= ~shadow_exits;
+		secondary |= SECONDARY_EXEC_ENABLE_EPT;
+	} else {
+		cpu_based |= shadow_exits;
+		secondary &= ~SECONDARY_EXEC_ENABLE_EPT;
+	}
+	vmcs_write32_fixedbits(MSR_IA32_VMX_PROCBASED_CTLS_MSR,
+			       CPU_BASED_VM_EXEC_CONTROL, cpu_based);
+	vmcs_write32_fixedbits(MSR_IA32_VMX_PROCBASED_CTLS2,
+			       SECONDARY_VM_EXEC_CONTROL, secondary);
+
+	set_guest_cr0(vcpu, vcpu_vmcs_readl(vcpu, VCPU_VMCS_CR0_SHADOW));
+	__set_cr4(vcpu, vcpu_vmcs_readl(vcpu, VCPU_VMCS_CR4_SHADOW));
+	update_exception_bitmap(vcpu);
+}
+
 /*
  * Sets up the vmcs for emulated real mode.
  */
@@ -1104,6 +2304,7 @@ static int litevm_vcpu_setup(struct litevm_vcpu *vcpu)
 	extern asmlinkage void litevm_vmx_return(void);
 	u32 host_sysenter_cs;
 	u32 junk;
+	u32 secondary = 0;
 	unsigned long a;
 	struct descriptor_table dt;
 	int i;
@@ -1119,7 +2320,7 @@ static int litevm_vcpu_setup(struct litevm_vcpu *vcpu)
 
 	memset(vcpu->regs, 0, sizeof(vcpu->regs));
 	vcpu->regs[VCPU_REGS_RDX] = get_rdx_init_val();
-	vcpu->cr8 = 0;
+	__set_cr8(vcpu, 0);
 	vcpu->apic_base = 0xfee00000 |
 			/*for vcpu 0*/ MSR_IA32_APICBASE_BSP |
 			MSR_IA32_APICBASE_ENABLE;
@@ -1140,7 +2341,7 @@ static int litevm_vcpu_setup(struct litevm_vcpu *vcpu)
 	vmcs_write16(GUEST_CS_SELECTOR, 0xf000);
 	vmcs_writel(GUEST_CS_BASE, 0x000f0000);
 	vmcs_write32(GUEST_CS_LIMIT, 0xffff);
-	vmcs_write32(GUEST_CS_AR_BYTES, 0x9b);
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_CS_AR, 0x9b);
 
 	SEG_SETUP(DS);
 	SEG_SETUP(ES);
@@ -1162,9 +2363,9 @@ static int litevm_vcpu_setup(struct litevm_vcpu *vcpu)
 	vmcs_writel(GUEST_SYSENTER_ESP, 0);
 	vmcs_writel(GUEST_SYSENTER_EIP, 0);
 
-	vmcs_writel(GUEST_RFLAGS, 0x02);
-	vmcs_writel(GUEST_RIP, 0xfff0);
-	vmcs_writel(GUEST_RSP, 0);
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_RFLAGS, 0x02);
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_RIP, 0xfff0);
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_RSP, 0);
 
 	vmcs_writel(GUEST_CR3, 0);
 
@@ -1182,8 +2383,9 @@ static int litevm_vcpu_setup(struct litevm_vcpu *vcpu)
 	vmcs_write32(GUEST_PENDING_DBG_EXCEPTIONS, 0);
 
 	/* I/O */
-	vmcs_write64(IO_BITMAP_A, 0);
-	vmcs_write64(IO_BITMAP_B, 0);
+	vmcs_write64(IO_BITMAP_A, __pa(vcpu->litevm->io_bitmap));
+	vmcs_write64(IO_BITMAP_B, __pa(vcpu->litevm->io_bitmap) + PAGE_SIZE);
+	vmcs_write64(MSR_BITMAP, __pa(vcpu->litevm->msr_bitmap));
 
 	rdtscll(tsc);
 	vmcs_write64(TSC_OFFSET, -tsc);
@@ -1199,18 +2401,36 @@ static int litevm_vcpu_setup(struct litevm_vcpu *vcpu)
 			       PIN_BASED_EXT_INTR_MASK   /* 20.6.1 */
 			       | PIN_BASED_NMI_EXITING   /* 20.6.1 */
 			);
+	if (vcpu->vpid)
+		secondary |= SECONDARY_EXEC_ENABLE_VPID;
+	if (vmx_has_ple)
+		secondary |= SECONDARY_EXEC_PAUSE_LOOP_EXITING;
 	vmcs_write32_fixedbits(MSR_IA32_VMX_PROCBASED_CTLS_MSR,
 			       CPU_BASED_VM_EXEC_CONTROL,
 			       CPU_BASED_HLT_EXITING         /* 20.6.2 */
-			       | CPU_BASED_CR8_LOAD_EXITING    /* 20.6.2 */
-			       | CPU_BASED_CR8_STORE_EXITING   /* 20.6.2 */
-			       | CPU_BASED_UNCOND_IO_EXITING   /* 20.6.2 */
+			       | (vcpu->vapic ? CPU_BASED_TPR_SHADOW
+				  : CPU_BASED_CR8_LOAD_EXITING    /* 20.6.2 */
+				  | CPU_BASED_CR8_STORE_EXITING)  /* 20.6.2 */
+			       | CPU_BASED_ACTIVATE_IO_BITMAP  /* 20.6.2 */
 			       | CPU_BASED_INVDPG_EXITING
 			       | CPU_BASED_MOV_DR_EXITING
 			       | CPU_BASED_USE_TSC_OFFSETING   /* 21.3 */
+			       | CPU_BASED_MSR_BITMAPS
+			       | (secondary || vcpu->litevm->ept ?
+				  CPU_BASED_ACTIVATE_SECONDARY_CONTROLS : 0)
 			);
+	/* ept is turned on by the mmu once the guest enables paging */
+	if (secondary || vcpu->litevm->ept)
+		vmcs_write32_fixedbits(MSR_IA32_VMX_PROCBASED_CTLS2,
+				       SECONDARY_VM_EXEC_CONTROL, secondary);
+	if (vcpu->vpid)
+		vmcs_write16(VIRTUAL_PROCESSOR_ID, vcpu->vpid);
+	if (vmx_has_ple) {
+		vmcs_write32(PLE_GAP, ple_gap);
+		vmcs_write32(PLE_WINDOW, ple_window);
+	}
 
-	vmcs_write32(EXCEPTION_BITMAP, 1 << PF_VECTOR);
+	update_exception_bitmap(vcpu);
 	vmcs_write32(PAGE_FAULT_ERROR_CODE_MASK, 0);
 	vmcs_write32(PAGE_FAULT_ERROR_CODE_MATCH, 0);
 	vmcs_write32(CR3_TARGET_COUNT, 0);           /* 22.2.1 */
@@ -1294,8 +2514,9 @@ static int litevm_vcpu_setup(struct litevm_vcpu *vcpu)
                                VM_ENTRY_CONTROLS, 0);
 	vmcs_write32(VM_ENTRY_INTR_INFO_FIELD, 0);  /* 22.2.1 */
 
-	vmcs_writel(VIRTUAL_APIC_PAGE_ADDR, 0);
-	vmcs_writel(TPR_THRESHOLD, 0);
+	vmcs_write64(VIRTUAL_APIC_PAGE_ADDR,
+		     vcpu->vapic ? __pa(vcpu->vapic) : 0);
+	vmcs_write32(TPR_THRESHOLD, 0);
 
 	vmcs_writel(CR0_GUEST_HOST_MASK, LITEVM_GUEST_CR0_MASK);
 	vmcs_writel(CR4_GUEST_HOST_MASK, LITEVM_GUEST_CR4_MASK);
@@ -1322,8 +2543,8 @@ out:
  */
 static void vcpu_load_rsp_rip(struct litevm_vcpu *vcpu)
 {
-	vcpu->regs[VCPU_REGS_RSP] = vmcs_readl(GUEST_RSP);
-	vcpu->rip = vmcs_readl(GUEST_RIP);
+	vcpu->regs[VCPU_REGS_RSP] = vcpu_vmcs_readl(vcpu, VCPU_VMCS_RSP);
+	vcpu->rip = vcpu_vmcs_readl(vcpu, VCPU_VMCS_RIP);
 }
 
 /*
@@ -1332,8 +2553,8 @@ static void vcpu_load_rsp_rip(struct litevm_vcpu *vcpu)
  */
 static void vcpu_put_rsp_rip(struct litevm_vcpu *vcpu)
 {
-	vmcs_writel(GUEST_RSP, vcpu->regs[VCPU_REGS_RSP]);
-	vmcs_writel(GUEST_RIP, vcpu->rip);
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_RSP, vcpu->regs[VCPU_REGS_RSP]);
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_RIP, vcpu->rip);
 }
 
 /*
@@ -1364,6 +2585,38 @@ static int litevm_dev_ioctl_create_vcpu(struct litevm *litevm, int n)
 
 	vcpu->cpu = -1;  /* First load will set up TR */
 	vcpu->litevm = litevm;
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+	preempt_notifier_init(&vcpu->preempt_notifier, &litevm_preempt_ops);
+#endif
+
+	r = -ENOMEM;
+	vcpu->run = (struct litevm_run *)get_zeroed_page(GFP_KERNEL);
+	if (!vcpu->run) {
+		mutex_unlock(&vcpu->mutex);
+		goto out_free_vcpus;
+	}
+	vcpu->run->vcpu = n;
+
+	vcpu->exit_stats = vzalloc(sizeof *vcpu->exit_stats);
+	if (!vcpu->exit_stats) {
+		mutex_unlock(&vcpu->mutex);
+		goto out_free_vcpus;
+	}
+
+	if (litevm_ring_init(&vcpu->exit_ring,
+			     sizeof(struct litevm_exit_record))) {
+		mutex_unlock(&vcpu->mutex);
+		goto out_free_vcpus;
+	}
+
+	if (vmx_has_tpr_shadow) {
+		vcpu->vapic = (u8 *)get_zeroed_page(GFP_KERNEL);
+		if (!vcpu->vapic) {
+			mutex_unlock(&vcpu->mutex);
+			goto out_free_vcpus;
+		}
+	}
+
 	vmcs = alloc_vmcs();
 	if (!vmcs) {
 		mutex_unlock(&vcpu->mutex);
@@ -1372,6 +2625,7 @@ static int litevm_dev_ioctl_create_vcpu(struct litevm *litevm, int n)
 	vmcs_clear(vmcs);
 	vcpu->vmcs = vmcs;
 	vcpu->launched = 0;
+	allocate_vpid(vcpu);
 
 	__vcpu_load(vcpu);
 
@@ -1417,6 +2671,10 @@ static int litevm_dev_ioctl_set_memory_region(struct litevm *litevm,
 		goto out;
 	if (mem->guest_phys_addr + mem->memory_size < mem->guest_phys_addr)
 		goto out;
+	/* The top of the mmap() space belongs to the vcpu run pages. */
+	if ((mem->guest_phys_addr + mem->memory_size) >> PAGE_SHIFT
+	    > LITEVM_RUN_PAGE_PGOFF)
+		goto out;
 
 	memslot = &litevm->memslots[mem->slot];
 	base_gfn = mem->guest_phys_addr >> PAGE_SHIFT;
@@ -1639,9 +2897,9 @@ static void skip_emulated_instruction(struct litevm_vcpu *vcpu)
 	unsigned long rip;
 	u32 interruptibility;
 
-	rip = vmcs_readl(GUEST_RIP);
+	rip = vcpu_vmcs_readl(vcpu, VCPU_VMCS_RIP);
 	rip += vmcs_read32(VM_EXIT_INSTRUCTION_LEN);
-	vmcs_writel(GUEST_RIP, rip);
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_RIP, rip);
 
 	/*
 	 * We emulated an instruction, so temporary interrupt blocking
@@ -1764,8 +3022,9 @@ static int emulator_cmpxchg_emulated(unsigned long addr,
 static void report_emulation_failure(struct x86_emulate_ctxt *ctxt)
 {
 	static int reported;
+	struct litevm_vcpu *vcpu = ctxt->vcpu;
 	u8 opcodes[4];
-	unsigned long rip = vmcs_readl(GUEST_RIP);
+	unsigned long rip = vcpu_vmcs_readl(vcpu, VCPU_VMCS_RIP);
 	unsigned long rip_linear = rip + vmcs_readl(GUEST_CS_BASE);
 
 	if (reported)
@@ -1793,10 +3052,10 @@ enum emulation_result {
 	EMULATE_FAIL,         /* can't emulate this instruction */
 };
 
-static int emulate_instruction(struct litevm_vcpu *vcpu,
-			       struct litevm_run *run,
-			       unsigned long cr2,
-			       u16 error_code)
+static int __emulate_instruction(struct litevm_vcpu *vcpu,
+				 struct litevm_run *run,
+				 unsigned long cr2,
+				 u16 error_code)
 {
 	struct x86_emulate_ctxt emulate_ctxt;
 	int r;
@@ -1804,10 +3063,10 @@ static int emulate_instruction(struct litevm_vcpu *vcpu,
 
 	vcpu_load_rsp_rip(vcpu);
 
-	cs_ar = vmcs_read32(GUEST_CS_AR_BYTES);
+	cs_ar = vcpu_vmcs_readl(vcpu, VCPU_VMCS_CS_AR);
 
 	emulate_ctxt.vcpu = vcpu;
-	emulate_ctxt.eflags = vmcs_readl(GUEST_RFLAGS);
+	emulate_ctxt.eflags = vcpu_vmcs_readl(vcpu, VCPU_VMCS_RFLAGS);
 	emulate_ctxt.cr2 = cr2;
 	emulate_ctxt.mode = (emulate_ctxt.eflags & X86_EFLAGS_VM)
 		? X86EMUL_MODE_REAL : (cs_ar & AR_L_MASK)
@@ -1849,7 +3108,7 @@ static int emulate_instruction(struct litevm_vcpu *vcpu,
 	}
 
 	vcpu_put_rsp_rip(vcpu);
-	vmcs_writel(GUEST_RFLAGS, emulate_ctxt.eflags);
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_RFLAGS, emulate_ctxt.eflags);
 
 	if (vcpu->mmio_is_write)
 		return EMULATE_DO_MMIO;
@@ -1857,6 +3116,19 @@ static int emulate_instruction(struct litevm_vcpu *vcpu,
 	return EMULATE_DONE;
 }
 
+static int emulate_instruction(struct litevm_vcpu *vcpu,
+			       struct litevm_run *run,
+			       unsigned long cr2,
+			       u16 error_code)
+{
+	unsigned long rip = vcpu_vmcs_readl(vcpu, VCPU_VMCS_RIP);
+	int r;
+
+	r = __emulate_instruction(vcpu, run, cr2, error_code);
+	trace_litevm_emulate(rip, cr2, r);
+	return r;
+}
+
 static u64 mk_cr_64(u64 curr_cr, u32 new_val)
 {
 	return (curr_cr & ~((1ULL << 32) - 1)) | new_val;
@@ -1878,20 +3150,20 @@ void realmode_lmsw(struct litevm_vcpu *vcpu, unsigned long msw,
 		   unsigned long *rflags)
 {
 	lmsw(vcpu, msw);
-	*rflags = vmcs_readl(GUEST_RFLAGS);
+	*rflags = vcpu_vmcs_readl(vcpu, VCPU_VMCS_RFLAGS);
 }
 
 unsigned long realmode_get_cr(struct litevm_vcpu *vcpu, int cr)
 {
 	switch (cr) {
 	case 0:
-		return guest_cr0();
+		return guest_cr0(vcpu);
 	case 2:
 		return vcpu->cr2;
 	case 3:
 		return vcpu->cr3;
 	case 4:
-		return guest_cr4();
+		return guest_cr4(vcpu);
 	default:
 		vcpu_printf(vcpu, "%s: unexpected cr %u\n", __FUNCTION__, cr);
 		return 0;
@@ -1903,8 +3175,8 @@ void realmode_set_cr(struct litevm_vcpu *vcpu, int cr, unsigned long val,
 {
 	switch (cr) {
 	case 0:
-		set_cr0(vcpu, mk_cr_64(guest_cr0(), val));
-		*rflags = vmcs_readl(GUEST_RFLAGS);
+		set_cr0(vcpu, mk_cr_64(guest_cr0(vcpu), val));
+		*rflags = vcpu_vmcs_readl(vcpu, VCPU_VMCS_RFLAGS);
 		break;
 	case 2:
 		vcpu->cr2 = val;
@@ -1913,7 +3185,7 @@ void realmode_set_cr(struct litevm_vcpu *vcpu, int cr, unsigned long val,
 		set_cr3(vcpu, val);
 		break;
 	case 4:
-		set_cr4(vcpu, mk_cr_64(guest_cr4(), val));
+		set_cr4(vcpu, mk_cr_64(guest_cr4(vcpu), val));
 		break;
 	default:
 		vcpu_printf(vcpu, "%s: unexpected cr %u\n", __FUNCTION__, cr);
@@ -1958,8 +3230,20 @@ static int handle_exception(struct litevm_vcpu *vcpu, struct litevm_run *litevm_
 		asm ("int $2");
 		return 1;
 	}
+
+	if (!vcpu->fpu_active &&
+	    (intr_info & (INTR_INFO_INTR_TYPE_MASK | INTR_INFO_VECTOR_MASK))
+	    == (INTR_TYPE_EXCEPTION | NM_VECTOR)) {
+		/*
+		 * First fpu use since the vcpu was loaded.  If the guest has
+		 * TS set itself, it will fault again and see its own #NM.
+		 */
+		litevm_load_guest_fpu(vcpu);
+		return 1;
+	}
+
 	error_code = 0;
-	rip = vmcs_readl(GUEST_RIP);
+	rip = vcpu_vmcs_readl(vcpu, VCPU_VMCS_RIP);
 	if (intr_info & INTR_INFO_DELIEVER_CODE_MASK)
 		error_code = vmcs_read32(VM_EXIT_INTR_ERROR_CODE);
 	if (is_page_fault(intr_info)) {
@@ -1978,7 +3262,10 @@ static int handle_exception(struct litevm_vcpu *vcpu, struct litevm_run *litevm_
 		case EMULATE_DONE:
 			return 1;
 		case EMULATE_DO_MMIO:
-			++litevm_stat.mmio_exits;
+			++vcpu->stat->mmio_exits;
+			trace_litevm_mmio(litevm_run->mmio.is_write,
+					  litevm_run->mmio.phys_addr,
+					  litevm_run->mmio.len);
 			litevm_run->exit_reason = LITEVM_EXIT_MMIO;
 			return 0;
 		 case EMULATE_FAIL:
@@ -2007,7 +3294,7 @@ static int handle_exception(struct litevm_vcpu *vcpu, struct litevm_run *litevm_
 static int handle_external_interrupt(struct litevm_vcpu *vcpu,
 				     struct litevm_run *litevm_run)
 {
-	++litevm_stat.irq_exits;
+	++vcpu->stat->irq_exits;
 	return 1;
 }
 
@@ -2019,16 +3306,16 @@ static int get_io_count(struct litevm_vcpu *vcpu, u64 *count)
 	int countr_size;
 	int i, n;
 
-	if ((vmcs_readl(GUEST_RFLAGS) & X86_EFLAGS_VM)) {
+	if ((vcpu_vmcs_readl(vcpu, VCPU_VMCS_RFLAGS) & X86_EFLAGS_VM)) {
 		countr_size = 2;
 	} else {
-		u32 cs_ar = vmcs_read32(GUEST_CS_AR_BYTES);
+		u32 cs_ar = vcpu_vmcs_readl(vcpu, VCPU_VMCS_CS_AR);
 
 		countr_size = (cs_ar & AR_L_MASK) ? 8:
 			      (cs_ar & AR_DB_MASK) ? 4: 2;
 	}
 
-	rip =  vmcs_readl(GUEST_RIP);
+	rip =  vcpu_vmcs_readl(vcpu, VCPU_VMCS_RIP);
 	if (countr_size != 8)
 		rip += vmcs_readl(GUEST_CS_BASE);
 
@@ -2060,12 +3347,47 @@ done:
 	return 1;
 }
 
+/*
+ * Complete a non-string in/out without leaving the kernel if every port
+ * it touches is LITEVM_IO_IGNORE.  Returns 1 if handled.
+ */
+static int kernel_io(struct litevm_vcpu *vcpu, u16 port, int size, int in)
+{
+	unsigned long *rax = &vcpu->regs[VCPU_REGS_RAX];
+	int i;
+
+	for (i = 0; i < size; ++i)
+		if (port + i >= LITEVM_NR_IO_PORTS
+		    || !test_bit(port + i, vcpu->litevm->io_ignore))
+			return 0;
+	if (!in)
+		return 1;
+	switch (size) {
+	case 1:
+		*rax |= 0xff;
+		break;
+	case 2:
+		*rax |= 0xffff;
+		break;
+	case 4:
+		*rax = 0xffffffff;	/* in eax zero extends, like mov */
+		break;
+	}
+	return 1;
+}
+
 static int handle_io(struct litevm_vcpu *vcpu, struct litevm_run *litevm_run)
 {
 	u64 exit_qualification;
 
-	++litevm_stat.io_exits;
+	++vcpu->stat->io_exits;
 	exit_qualification = vmcs_read64(EXIT_QUALIFICATION);
+	if (!(exit_qualification & 16)
+	    && kernel_io(vcpu, exit_qualification >> 16,
+			 (exit_qualification & 7) + 1, exit_qualification & 8)) {
+		skip_emulated_instruction(vcpu);
+		return 1;
+	}
 	litevm_run->exit_reason = LITEVM_EXIT_IO;
 	if (exit_qualification & 8)
 		litevm_run->io.direction = LITEVM_EXIT_IO_IN;
@@ -2074,7 +3396,7 @@ static int handle_io(struct litevm_vcpu *vcpu, struct litevm_run *litevm_run)
 	litevm_run->io.size = (exit_qualification & 7) + 1;
 	litevm_run->io.string = (exit_qualification & 16) != 0;
 	litevm_run->io.string_down
-		= (vmcs_readl(GUEST_RFLAGS) & X86_EFLAGS_DF) != 0;
+		= (vcpu_vmcs_readl(vcpu, VCPU_VMCS_RFLAGS) & X86_EFLAGS_DF) != 0;
 	litevm_run->io.rep = (exit_qualification & 32) != 0;
 	litevm_run->io.port = exit_qualification >> 16;
 	if (litevm_run->io.string) {
@@ -2083,6 +3405,11 @@ static int handle_io(struct litevm_vcpu *vcpu, struct litevm_run *litevm_run)
 		litevm_run->io.address = vmcs_readl(GUEST_LINEAR_ADDRESS);
 	} else
 		litevm_run->io.value = vcpu->regs[VCPU_REGS_RAX]; /* rax */
+	trace_litevm_io(litevm_run->io.direction == LITEVM_EXIT_IO_IN,
+			litevm_run->io.port, litevm_run->io.size,
+			litevm_run->io.string,
+			litevm_run->io.string ? litevm_run->io.count
+			: litevm_run->io.value);
 	return 0;
 }
 
@@ -2093,7 +3420,7 @@ static int handle_invlpg(struct litevm_vcpu *vcpu, struct litevm_run *litevm_run
 	spin_lock(&vcpu->litevm->lock);
 	vcpu->mmu.inval_page(vcpu, address);
 	spin_unlock(&vcpu->litevm->lock);
-	vmcs_writel(GUEST_RIP, vmcs_readl(GUEST_RIP) + instruction_length);
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_RIP, vcpu_vmcs_readl(vcpu, VCPU_VMCS_RIP) + instruction_length);
 	return 1;
 }
 
@@ -2157,6 +3484,10 @@ static int handle_cr(struct litevm_vcpu *vcpu, struct litevm_run *litevm_run)
 			return 1;
 		}
 		break;
+	case 2: /* clts */
+		set_guest_cr0(vcpu, guest_cr0(vcpu) & ~CR0_TS_MASK);
+		skip_emulated_instruction(vcpu);
+		return 1;
 	case 3: /* lmsw */
 		lmsw(vcpu, (exit_qualification >> LMSW_SOURCE_DATA_SHIFT) & 0x0f);
 
@@ -2212,12 +3543,51 @@ static int handle_cpuid(struct litevm_vcpu *vcpu, struct litevm_run *litevm_run)
 	return 0;
 }
 
+static int msr_exit_to_user(struct litevm_vcpu *vcpu,
+			    struct litevm_run *litevm_run,
+			    u32 index, int is_write, u64 data)
+{
+	int i = msr_bitmap_index(index);
+
+	if (i < 0 || !test_bit(i, vcpu->litevm->msr_user))
+		return 0;
+	litevm_run->exit_reason = LITEVM_EXIT_MSR;
+	litevm_run->msr.index = index;
+	litevm_run->msr.is_write = is_write;
+	litevm_run->msr.error = 0;
+	litevm_run->msr.data = data;
+	vcpu->msr_exit = is_write ? MSR_EXIT_WRITE : MSR_EXIT_READ;
+	return 1;
+}
+
+/*
+ * Finish an rdmsr or wrmsr that userspace handled.
+ */
+static void complete_msr_exit(struct litevm_vcpu *vcpu,
+			      struct litevm_run *litevm_run)
+{
+	if (litevm_run->msr.error)
+		inject_gp(vcpu);
+	else {
+		if (vcpu->msr_exit == MSR_EXIT_READ) {
+			vcpu->regs[VCPU_REGS_RAX] = litevm_run->msr.data & -1u;
+			vcpu->regs[VCPU_REGS_RDX] =
+				(litevm_run->msr.data >> 32) & -1u;
+		}
+		skip_emulated_instruction(vcpu);
+	}
+	vcpu->msr_exit = 0;
+}
+
 static int handle_rdmsr(struct litevm_vcpu *vcpu, struct litevm_run *litevm_run)
 {
 	u32 ecx = vcpu->regs[VCPU_REGS_RCX];
 	struct vmx_msr_entry *msr = find_msr_entry(vcpu, ecx);
 	u64 data;
 
+	if (msr_exit_to_user(vcpu, litevm_run, ecx, 0, 0))
+		return 0;
+
 #ifdef LITEVM_DEBUG
 	if (guest_cpl() != 0) {
 		vcpu_printf(vcpu, "%s: not supervisor\n", __FUNCTION__);
@@ -2291,7 +3661,7 @@ static void set_efer(struct litevm_vcpu *vcpu, u64 efer)
 		return;
 	}
 
-	if (is_paging() && (vcpu->shadow_efer & EFER_LME) != (efer & EFER_LME)) {
+	if (is_paging(vcpu) && (vcpu->shadow_efer & EFER_LME) != (efer & EFER_LME)) {
 		printk(KERN_DEBUG "set_efer: #GP, change LME while paging\n");
 		inject_gp(vcpu);
 		return;
@@ -2321,6 +3691,9 @@ static int handle_wrmsr(struct litevm_vcpu *vcpu, struct litevm_run *litevm_run)
 	u64 data = (vcpu->regs[VCPU_REGS_RAX] & -1u)
 		| ((u64)(vcpu->regs[VCPU_REGS_RDX] & -1u) << 32);
 
+	if (msr_exit_to_user(vcpu, litevm_run, ecx, 1, data))
+		return 0;
+
 #ifdef LITEVM_DEBUG
 	if (guest_cpl() != 0) {
 		vcpu_printf(vcpu, "%s: not supervisor\n", __FUNCTION__);
@@ -2373,7 +3746,18 @@ static int handle_wrmsr(struct litevm_vcpu *vcpu, struct litevm_run *litevm_run)
 	default:
 		msr = find_msr_entry(vcpu, ecx);
 		if (msr) {
+			/*
+			 * Manually switched and already live: update the
+			 * cpu.  litevm_sched_out() would otherwise swap the
+			 * host values in between, or save the old value
+			 * over the new one.
+			 */
+			preempt_disable();
 			msr->data = data;
+			if (vcpu->guest_msrs_loaded &&
+			    msr - vcpu->guest_msrs < NR_BAD_MSRS)
+				wrmsrl(msr->index, msr->data);
+			preempt_enable();
 			break;
 		}
 		printk(KERN_ERR "litevm: unhandled wrmsr: %x\n", ecx);
@@ -2394,13 +3778,351 @@ static int handle_interrupt_window(struct litevm_vcpu *vcpu,
 	return 1;
 }
 
+/*
+ * The irq litevm_do_inject_irq() will pick next: the highest vector, as
+ * the local apic would, so a blocked low priority irq can't hold back a
+ * higher one.  -1 if there is none.
+ *
+ * litevm_dev_ioctl_interrupt() sets the pending bit and then the summary
+ * bit, without the mutex.  If it is slow, we may inject the irq before
+ * its summary bit lands, which leaves that bit over an empty word; such
+ * bits are cleared here.
+ */
+static int next_irq(struct litevm_vcpu *vcpu)
+{
+	int word_index;
+	unsigned long pending;
+
+	while (vcpu->irq_summary) {
+		word_index = __fls(vcpu->irq_summary);
+		pending = ACCESS_ONCE(vcpu->irq_pending[word_index]);
+		if (pending)
+			return word_index * BITS_PER_LONG + __fls(pending);
+		clear_bit(word_index, &vcpu->irq_summary);
+		smp_mb__after_clear_bit();
+		if (vcpu->irq_pending[word_index])
+			set_bit(word_index, &vcpu->irq_summary);
+	}
+	return -1;
+}
+
+/*
+ * Held back by the guest's task priority: it gets in once cr8 drops
+ * below its priority class.  Vectors 0-15 are class 0, held back by any
+ * nonzero cr8.  Real mode delivers through the ivt, so there it always
+ * goes.  As next_irq() is the highest, all the others are held back too.
+ */
+static int irq_blocked_by_tpr(struct litevm_vcpu *vcpu)
+{
+	int irq;
+
+	if (!vcpu->cr8 || vcpu->rmode.active)
+		return 0;
+	irq = next_irq(vcpu);
+	return irq >= 0 && (irq >> 4) <= vcpu->cr8;
+}
+
+/*
+ * With a tpr shadow the cpu exits when the guest's tpr drops below the
+ * threshold, so point it at the class of a blocked irq.  It must not
+ * exceed the tpr at entry, hence rewriting it every time.
+ */
+static void update_tpr_threshold(struct litevm_vcpu *vcpu)
+{
+	int threshold = 0;
+
+	if (vcpu->irq_summary && irq_blocked_by_tpr(vcpu))
+		threshold = next_irq(vcpu) >> 4;
+	vmcs_write32(TPR_THRESHOLD, threshold);
+}
+
+/*
+ * A vcpu spinning in the guest is probably waiting on a lock held by a
+ * sibling whose thread got preempted; hand that thread our cpu time.
+ */
+static void litevm_vcpu_on_spin(struct litevm_vcpu *me)
+{
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+	struct litevm *litevm = me->litevm;
+	int start = litevm->last_boosted_vcpu;
+	int i;
+
+	for (i = 1; i <= LITEVM_MAX_VCPUS; ++i) {
+		int n = (start + i) % LITEVM_MAX_VCPUS;
+		struct litevm_vcpu *vcpu = &litevm->vcpus[n];
+		struct task_struct *task = 0;
+
+		if (vcpu == me || !vcpu->preempted)
+			continue;
+		rcu_read_lock();
+		if (vcpu->pid)
+			task = pid_task(rcu_dereference(vcpu->pid), PIDTYPE_PID);
+		if (task)
+			get_task_struct(task);
+		rcu_read_unlock();
+		if (!task)
+			continue;
+		if (yield_to(task, 1) > 0) {
+			put_task_struct(task);
+			litevm->last_boosted_vcpu = n;
+			++me->stat->directed_yield;
+			return;
+		}
+		put_task_struct(task);
+	}
+	yield();
+#else
+	vcpu_put(me);
+	yield();
+	/* Cannot fail -  no vcpu unplug yet. */
+	vcpu_load(me->litevm, vcpu_slot(me));
+#endif
+}
+
+static int handle_pause(struct litevm_vcpu *vcpu, struct litevm_run *litevm_run)
+{
+	++vcpu->stat->pause_exits;
+	skip_emulated_instruction(vcpu);
+	litevm_vcpu_on_spin(vcpu);
+	return 1;
+}
+
+static int handle_preemption_timer(struct litevm_vcpu *vcpu,
+				   struct litevm_run *litevm_run)
+{
+	/* litevm_arm_preemption_timer() decides on the way back in */
+	return 1;
+}
+
+static int handle_tpr_below_threshold(struct litevm_vcpu *vcpu,
+				      struct litevm_run *litevm_run)
+{
+	/* cr8 was picked up after the exit; the irq goes in on entry */
+	return 1;
+}
+
+static int irq_deliverable(struct litevm_vcpu *vcpu)
+{
+	return next_irq(vcpu) >= 0 && !irq_blocked_by_tpr(vcpu);
+}
+
+static void account_halt_wakeup(struct litevm_vcpu *vcpu)
+{
+	u32 us;
+
+	us = ktime_to_us(ktime_sub(ktime_get(), vcpu->wakeup_time));
+	++vcpu->stat->halt_wakeup;
+	vcpu->stat->halt_wakeup_us += us;
+	if (us > vcpu->stat->halt_wakeup_us_max)
+		vcpu->stat->halt_wakeup_us_max = us;
+}
+
+static void grow_halt_poll(struct litevm_vcpu *vcpu)
+{
+	unsigned int us = vcpu->halt_poll_us * 2;
+
+	if (us < HALT_POLL_START_US)
+		us = HALT_POLL_START_US;
+	if (us > halt_poll_max_us)
+		us = halt_poll_max_us;
+	vcpu->halt_poll_us = us;
+}
+
+static void shrink_halt_poll(struct litevm_vcpu *vcpu)
+{
+	vcpu->halt_poll_us /= 2;
+	if (vcpu->halt_poll_us < HALT_POLL_START_US)
+		vcpu->halt_poll_us = 0;
+}
+
+/*
+ * Spin for up to the vcpu's poll window; an irq that shows up in the
+ * meantime saves both the sleep and the wakeup.
+ */
+static int halt_poll(struct litevm_vcpu *vcpu, ktime_t start)
+{
+	ktime_t stop = ktime_add_ns(start, vcpu->halt_poll_us * NSEC_PER_USEC);
+	int r = 0;
+
+	++vcpu->stat->halt_attempted_poll;
+	do {
+		if (irq_deliverable(vcpu)) {
+			++vcpu->stat->halt_successful_poll;
+			r = 1;
+			break;
+		}
+		cpu_relax();
+	} while (!need_resched() && !signal_pending(current)
+		 && ktime_before(ktime_get(), stop));
+	vcpu->stat->halt_poll_us += ktime_to_us(ktime_sub(ktime_get(), start));
+	return r;
+}
+
+/*
+ * Sleep until litevm_dev_ioctl_interrupt() queues something the guest
+ * will take, or a signal needs the thread back in userspace.  The
+ * interrupt ioctl doesn't need the vcpu, but the vcpu is put anyway:
+ * without preempt notifiers a loaded vcpu keeps preemption off.
+ */
+static void litevm_vcpu_block(struct litevm_vcpu *vcpu)
+{
+	DEFINE_WAIT(wait);
+	ktime_t start;
+	s64 halted_us;
+
+	vcpu->wakeup_time = ktime_set(0, 0);
+	vcpu_put(vcpu);
+	start = ktime_get();
+	if (vcpu->halt_poll_us && halt_poll(vcpu, start))
+		goto out;
+	for (;;) {
+		prepare_to_wait(&vcpu->wq, &wait, TASK_INTERRUPTIBLE);
+		if (irq_deliverable(vcpu) || signal_pending(current))
+			break;
+		schedule();
+	}
+	finish_wait(&vcpu->wq, &wait);
+
+	/*
+	 * A halt the window would have covered says poll longer; one far
+	 * past the limit says the guest is idle and spinning is waste.
+	 */
+	halted_us = ktime_to_us(ktime_sub(ktime_get(), start));
+	if (halted_us > halt_poll_max_us)
+		shrink_halt_poll(vcpu);
+	else if (!signal_pending(current))
+		grow_halt_poll(vcpu);
+out:
+	/* Cannot fail -  no vcpu unplug yet. */
+	vcpu_load(vcpu->litevm, vcpu_slot(vcpu));
+	if (ktime_to_ns(vcpu->wakeup_time))
+		account_halt_wakeup(vcpu);
+}
+
+/*
+ * Raise the interrupts that come next in the replay, as userspace did
+ * while recording.
+ */
+static void replay_irqs(struct litevm_vcpu *vcpu)
+{
+	struct litevm_replay_record *rec;
+
+	while (vcpu->replay_pos < vcpu->replay_len) {
+		rec = &vcpu->replay[vcpu->replay_pos];
+		if (!(rec->flags & LITEVM_REPLAY_IRQ) || rec->key >= 256)
+			break;
+		set_bit(rec->key, vcpu->irq_pending);
+		set_bit(rec->key / BITS_PER_LONG, &vcpu->irq_summary);
+		++vcpu->replay_pos;
+	}
+}
+
 static int handle_halt(struct litevm_vcpu *vcpu, struct litevm_run *litevm_run)
 {
 	skip_emulated_instruction(vcpu);
-	if (vcpu->irq_summary && (vmcs_readl(GUEST_RFLAGS) & X86_EFLAGS_IF))
+	/*
+	 * With interrupts off only userspace can get it going again.  With a
+	 * cycle budget, userspace wants the cpu back rather than a sleep.
+	 */
+	if (!(vcpu_vmcs_readl(vcpu, VCPU_VMCS_RFLAGS) & X86_EFLAGS_IF)
+	    || vcpu->budget_deadline) {
+		litevm_run->exit_reason = LITEVM_EXIT_HLT;
+		return 0;
+	}
+	++vcpu->stat->halt_exits;
+	if (vcpu->replay_mode == LITEVM_REPLAY_PLAY)
+		replay_irqs(vcpu);	/* what woke it when recording */
+	if (!irq_deliverable(vcpu))
+		litevm_vcpu_block(vcpu);
+	return 1;	/* the run loop takes care of a pending signal */
+}
+
+/*
+ * The exit came while the cpu was delivering an event, which is lost
+ * unless we deliver it again on the next entry.
+ */
+static void requeue_vectoring_event(struct litevm_vcpu *vcpu, u32 vect_info)
+{
+	if (!(vect_info & VECTORING_INFO_VALID_MASK))
+		return;
+	if (is_external_interrupt(vect_info)) {
+		int irq = vect_info & VECTORING_INFO_VECTOR_MASK;
+
+		set_bit(irq, vcpu->irq_pending);
+		set_bit(irq / BITS_PER_LONG, &vcpu->irq_summary);
+		return;
+	}
+	if (vect_info & VECTORING_INFO_DELIEVER_CODE_MASK)
+		vmcs_write32(VM_ENTRY_EXCEPTION_ERROR_CODE,
+			     vmcs_read32(IDT_VECTORING_ERROR_CODE));
+	/* software interrupts and exceptions need the instruction length */
+	vmcs_write32(VM_ENTRY_INSTRUCTION_LEN,
+		     vmcs_read32(VM_EXIT_INSTRUCTION_LEN));
+	vmcs_write32(VM_ENTRY_INTR_INFO_FIELD,
+		     vect_info & (VECTORING_INFO_VECTOR_MASK
+				  | VECTORING_INFO_TYPE_MASK
+				  | VECTORING_INFO_DELIEVER_CODE_MASK
+				  | VECTORING_INFO_VALID_MASK));
+}
+
+/*
+ * A guest physical address missing from the ept tables: either memory
+ * we haven't mapped yet, a page write protected for dirty logging, or mmio.
+ */
+static int handle_ept_violation(struct litevm_vcpu *vcpu,
+				struct litevm_run *litevm_run)
+{
+	u64 exit_qualification = vmcs_read64(EXIT_QUALIFICATION);
+	gpa_t gpa = vmcs_read64(GUEST_PHYSICAL_ADDRESS);
+	u32 vect_info = vmcs_read32(IDT_VECTORING_INFO_FIELD);
+	unsigned long gva = 0;
+	enum emulation_result er;
+
+	if (exit_qualification & (1 << 7))	/* linear address valid */
+		gva = vmcs_readl(GUEST_LINEAR_ADDRESS);
+
+	spin_lock(&vcpu->litevm->lock);
+	if (!vcpu->mmu.page_fault(vcpu, gpa, exit_qualification)) {
+		spin_unlock(&vcpu->litevm->lock);
+		/* common: the idt, a stack or a handler not mapped yet */
+		requeue_vectoring_event(vcpu, vect_info);
 		return 1;
+	}
+
+	/*
+	 * Delivering an event through mmio: the instruction at rip has
+	 * nothing to do with it, so there's nothing to emulate.
+	 */
+	if (vect_info & VECTORING_INFO_VALID_MASK) {
+		spin_unlock(&vcpu->litevm->lock);
+		vcpu_printf(vcpu, "%s: event 0x%x delivered through mmio\n",
+			    __FUNCTION__, vect_info);
+		litevm_run->exit_reason = LITEVM_EXIT_UNKNOWN;
+		litevm_run->hw.hardware_exit_reason = EXIT_REASON_EPT_VIOLATION;
+		return 0;
+	}
+
+	er = emulate_instruction(vcpu, litevm_run, gva, 0);
+	spin_unlock(&vcpu->litevm->lock);
 
-	litevm_run->exit_reason = LITEVM_EXIT_HLT;
+	switch (er) {
+	case EMULATE_DONE:
+		return 1;
+	case EMULATE_DO_MMIO:
+		++vcpu->stat->mmio_exits;
+		trace_litevm_mmio(litevm_run->mmio.is_write,
+				  litevm_run->mmio.phys_addr,
+				  litevm_run->mmio.len);
+		litevm_run->exit_reason = LITEVM_EXIT_MMIO;
+		return 0;
+	case EMULATE_FAIL:
+		vcpu_printf(vcpu, "%s: emulate fail\n", __FUNCTION__);
+		break;
+	default:
+		BUG();
+	}
+	litevm_run->exit_reason = LITEVM_EXIT_UNKNOWN;
+	litevm_run->hw.hardware_exit_reason = EXIT_REASON_EPT_VIOLATION;
 	return 0;
 }
 
@@ -2422,11 +4144,40 @@ static int (*litevm_vmx_exit_handlers[])(struct litevm_vcpu *vcpu,
 	[EXIT_REASON_MSR_WRITE]               = handle_wrmsr,
 	[EXIT_REASON_PENDING_INTERRUPT]       = handle_interrupt_window,
 	[EXIT_REASON_HLT]                     = handle_halt,
+	[EXIT_REASON_EPT_VIOLATION]           = handle_ept_violation,
+	[EXIT_REASON_TPR_BELOW_THRESHOLD]     = handle_tpr_below_threshold,
+	[EXIT_REASON_PREEMPTION_TIMER]        = handle_preemption_timer,
+	[EXIT_REASON_PAUSE_INSTRUCTION]       = handle_pause,
 };
 
 static const int litevm_vmx_max_exit_handlers =
 	sizeof(litevm_vmx_exit_handlers) / sizeof(*litevm_vmx_exit_handlers);
 
+/*
+ * Once per sample period, note where the guest was at this exit.  The
+ * preemption timer makes sure there is an exit to take it at.
+ */
+static void litevm_sample_rip(struct litevm_vcpu *vcpu, u32 exit_reason)
+{
+	struct litevm_rip_sample *sample;
+	u64 now;
+
+	rdtscll(now);
+	if ((s64)(now - vcpu->next_sample) < 0)
+		return;
+	vcpu->next_sample = now + vcpu->sample_period;
+	sample = litevm_ring_reserve(&vcpu->sample_ring);
+	if (!sample)
+		return;
+	sample->tsc = now;
+	sample->rip = vcpu_vmcs_readl(vcpu, VCPU_VMCS_RIP);
+	sample->cr3 = vcpu->cr3;
+	sample->cs = vmcs_read16(GUEST_CS_SELECTOR);
+	sample->cpl = vcpu->rmode.active ? 0 : sample->cs & 3;
+	sample->exit_reason = exit_reason;
+	litevm_ring_commit(&vcpu->sample_ring);
+}
+
 /*
  * The guest has exited.  See if we can fix it or if we need userspace
  * assistance.
@@ -2435,20 +4186,42 @@ static int litevm_handle_exit(struct litevm_run *litevm_run, struct litevm_vcpu
 {
 	u32 vectoring_info = vmcs_read32(IDT_VECTORING_INFO_FIELD);
 	u32 exit_reason = vmcs_read32(VM_EXIT_REASON);
+	struct litevm_exit_record *rec;
+	unsigned long rip;
+	u64 start, end;
+	int r = 0;
 
 	if ( (vectoring_info & VECTORING_INFO_VALID_MASK) &&
-				exit_reason != EXIT_REASON_EXCEPTION_NMI )
+				exit_reason != EXIT_REASON_EXCEPTION_NMI &&
+				exit_reason != EXIT_REASON_EPT_VIOLATION )
 		printk(KERN_WARNING "%s: unexpected, valid vectoring info and "
 		       "exit reason is 0x%x\n", __FUNCTION__, exit_reason);
 	litevm_run->instruction_length = vmcs_read32(VM_EXIT_INSTRUCTION_LEN);
+	trace_litevm_exit(vcpu, exit_reason);
+	if (vcpu->sample_period)
+		litevm_sample_rip(vcpu, exit_reason);
+	rip = vcpu_vmcs_readl(vcpu, VCPU_VMCS_RIP);	/* before it's skipped */
+	rdtscll(start);
 	if (exit_reason < litevm_vmx_max_exit_handlers
 	    && litevm_vmx_exit_handlers[exit_reason])
-		return litevm_vmx_exit_handlers[exit_reason](vcpu, litevm_run);
+		r = litevm_vmx_exit_handlers[exit_reason](vcpu, litevm_run);
 	else {
 		litevm_run->exit_reason = LITEVM_EXIT_UNKNOWN;
 		litevm_run->hw.hardware_exit_reason = exit_reason;
 	}
-	return 0;
+	rdtscll(end);
+	account_exit(vcpu, exit_reason, end - start);
+
+	rec = litevm_ring_reserve(&vcpu->exit_ring);
+	if (rec) {
+		rec->tsc = start;
+		rec->rip = rip;
+		rec->qualification = vmcs_readl(EXIT_QUALIFICATION);
+		rec->exit_reason = exit_reason;
+		rec->cycles = min(end - start, 0xffffffffull);
+		litevm_ring_commit(&vcpu->exit_ring);
+	}
+	return r;
 }
 
 static void inject_rmode_irq(struct litevm_vcpu *vcpu, int irq)
@@ -2458,13 +4231,13 @@ static void inject_rmode_irq(struct litevm_vcpu *vcpu, int irq)
 	u16 ip;
 	unsigned long flags;
 	unsigned long ss_base = vmcs_readl(GUEST_SS_BASE);
-	u16 sp =  vmcs_readl(GUEST_RSP);
+	u16 sp =  vcpu_vmcs_readl(vcpu, VCPU_VMCS_RSP);
 	u32 ss_limit = vmcs_read32(GUEST_SS_LIMIT);
 
 	if (sp > ss_limit || sp - 6 > sp) {
 		vcpu_printf(vcpu, "%s: #SS, rsp 0x%lx ss 0x%lx limit 0x%x\n",
 			    __FUNCTION__,
-			    vmcs_readl(GUEST_RSP),
+			    vcpu_vmcs_readl(vcpu, VCPU_VMCS_RSP),
 			    vmcs_readl(GUEST_SS_BASE),
 			    vmcs_read32(GUEST_SS_LIMIT));
 		return;
@@ -2476,9 +4249,9 @@ static void inject_rmode_irq(struct litevm_vcpu *vcpu, int irq)
 		return;
 	}
 
-	flags =  vmcs_readl(GUEST_RFLAGS);
+	flags =  vcpu_vmcs_readl(vcpu, VCPU_VMCS_RFLAGS);
 	cs =  vmcs_readl(GUEST_CS_BASE) >> 4;
-	ip =  vmcs_readl(GUEST_RIP);
+	ip =  vcpu_vmcs_readl(vcpu, VCPU_VMCS_RIP);
 
 
 	if (litevm_write_guest(vcpu, ss_base + sp - 2, 2, &flags) != 2 ||
@@ -2488,143 +4261,353 @@ static void inject_rmode_irq(struct litevm_vcpu *vcpu, int irq)
 		return;
 	}
 
-	vmcs_writel(GUEST_RFLAGS, flags &
-		    ~( X86_EFLAGS_IF | X86_EFLAGS_AC | X86_EFLAGS_TF));
-	vmcs_write16(GUEST_CS_SELECTOR, ent[1]) ;
-	vmcs_writel(GUEST_CS_BASE, ent[1] << 4);
-	vmcs_writel(GUEST_RIP, ent[0]);
-	vmcs_writel(GUEST_RSP, (vmcs_readl(GUEST_RSP) & ~0xffff) | (sp - 6));
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_RFLAGS, flags &
+		    ~( X86_EFLAGS_IF | X86_EFLAGS_AC | X86_EFLAGS_TF));
+	vmcs_write16(GUEST_CS_SELECTOR, ent[1]) ;
+	vmcs_writel(GUEST_CS_BASE, ent[1] << 4);
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_RIP, ent[0]);
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_RSP, (vcpu_vmcs_readl(vcpu, VCPU_VMCS_RSP) & ~0xffff) | (sp - 6));
+}
+
+static void litevm_do_inject_irq(struct litevm_vcpu *vcpu)
+{
+	int irq = next_irq(vcpu);
+	int word_index;
+
+	if (irq < 0)
+		return;
+	word_index = irq / BITS_PER_LONG;
+	clear_bit(irq % BITS_PER_LONG, &vcpu->irq_pending[word_index]);
+	if (!vcpu->irq_pending[word_index]) {
+		clear_bit(word_index, &vcpu->irq_summary);
+		/* an irq raised in the same word meanwhile must stay visible */
+		smp_mb__after_clear_bit();
+		if (vcpu->irq_pending[word_index])
+			set_bit(word_index, &vcpu->irq_summary);
+	}
+
+	trace_litevm_inj_irq(irq, vcpu->rmode.active);
+
+	if (vcpu->rmode.active) {
+		inject_rmode_irq(vcpu, irq);
+		return;
+	}
+	vmcs_write32(VM_ENTRY_INTR_INFO_FIELD,
+			irq | INTR_TYPE_EXT_INTR | INTR_INFO_VALID_MASK);
+}
+
+static void litevm_try_inject_irq(struct litevm_vcpu *vcpu)
+{
+	if (next_irq(vcpu) < 0)
+		return;	/* only stale summary bits */
+	if (irq_blocked_by_tpr(vcpu))
+		return;	/* see update_tpr_threshold() */
+	if ((vcpu_vmcs_readl(vcpu, VCPU_VMCS_RFLAGS) & X86_EFLAGS_IF)
+	    && (vmcs_read32(GUEST_INTERRUPTIBILITY_INFO) & 3) == 0)
+		/*
+		 * Interrupts enabled, and not blocked by sti or mov ss. Good.
+		 */
+		litevm_do_inject_irq(vcpu);
+	else
+		/*
+		 * Interrupts blocked.  Wait for unblock.
+		 */
+		vmcs_write32(CPU_BASED_VM_EXEC_CONTROL,
+			     vmcs_read32(CPU_BASED_VM_EXEC_CONTROL)
+			     | CPU_BASED_VIRTUAL_INTR_PENDING);
+}
+
+static void litevm_guest_debug_pre(struct litevm_vcpu *vcpu)
+{
+	struct litevm_guest_debug *dbg = &vcpu->guest_debug;
+
+	set_debugreg(dbg->bp[0], 0);
+	set_debugreg(dbg->bp[1], 1);
+	set_debugreg(dbg->bp[2], 2);
+	set_debugreg(dbg->bp[3], 3);
+
+	if (dbg->singlestep) {
+		unsigned long flags;
+
+		flags = vcpu_vmcs_readl(vcpu, VCPU_VMCS_RFLAGS);
+		flags |= X86_EFLAGS_TF | X86_EFLAGS_RF;
+		vcpu_vmcs_writel(vcpu, VCPU_VMCS_RFLAGS, flags);
+	}
+}
+
+static void set_preemption_timer(struct litevm_vcpu *vcpu, int on)
+{
+	u32 pin;
+
+	if (vcpu->preemption_timer == on)
+		return;
+	pin = vmcs_read32(PIN_BASED_VM_EXEC_CONTROL);
+	if (on)
+		pin |= PIN_BASED_VMX_PREEMPTION_TIMER;
+	else
+		pin &= ~PIN_BASED_VMX_PREEMPTION_TIMER;
+	vmcs_write32(PIN_BASED_VM_EXEC_CONTROL, pin);
+	vcpu->preemption_timer = on;
+}
+
+/*
+ * Called before each entry while the preemption timer is on: arm it for
+ * the end of the cycle budget or the next rip sample, whichever comes
+ * first.  Returns 1 if the budget is all gone.
+ */
+static int litevm_arm_preemption_timer(struct litevm_vcpu *vcpu)
+{
+	u64 now, deadline, left = 0;
+
+	rdtscll(now);
+	deadline = vcpu->budget_deadline;
+	if (deadline && (s64)(deadline - now) <= 0)
+		return 1;
+	if (vcpu->sample_period
+	    && (!deadline || (s64)(vcpu->next_sample - deadline) < 0))
+		deadline = vcpu->next_sample;
+	if ((s64)(deadline - now) > 0)
+		left = (deadline - now) >> vmx_preemption_timer_shift;
+	if (left > 0xffffffffull)
+		left = 0xffffffffull;
+	vmcs_write32(VMX_PREEMPTION_TIMER_VALUE, left);
+	return 0;
+}
+
+/*
+ * Take in what userspace did about the last exit before running again.
+ */
+static void complete_user_exit(struct litevm_vcpu *vcpu,
+			       struct litevm_run *litevm_run)
+{
+	if (litevm_run->emulated) {
+		skip_emulated_instruction(vcpu);
+		litevm_run->emulated = 0;
+	}
+
+	if (litevm_run->mmio_completed) {
+		memcpy(vcpu->mmio_data, litevm_run->mmio.data, 8);
+		vcpu->mmio_read_completed = 1;
+	}
+
+	vcpu->mmio_needed = 0;
+
+	if (vcpu->msr_exit)
+		complete_msr_exit(vcpu, litevm_run);
 }
 
-static void litevm_do_inject_irq(struct litevm_vcpu *vcpu)
+/* what identifies an exit beside its reason and rip */
+static u64 replay_key(struct litevm_run *litevm_run)
 {
-	int word_index = __ffs(vcpu->irq_summary);
-	int bit_index = __ffs(vcpu->irq_pending[word_index]);
-	int irq = word_index * BITS_PER_LONG + bit_index;
-
-	clear_bit(bit_index, &vcpu->irq_pending[word_index]);
-	if (!vcpu->irq_pending[word_index])
-		clear_bit(word_index, &vcpu->irq_summary);
-
-	if (vcpu->rmode.active) {
-		inject_rmode_irq(vcpu, irq);
-		return;
+	switch (litevm_run->exit_reason) {
+	case LITEVM_EXIT_IO:
+		return litevm_run->io.port;
+	case LITEVM_EXIT_MMIO:
+		return litevm_run->mmio.phys_addr;
+	case LITEVM_EXIT_MSR:
+		return litevm_run->msr.index;
 	}
-	vmcs_write32(VM_ENTRY_INTR_INFO_FIELD,
-			irq | INTR_TYPE_EXT_INTR | INTR_INFO_VALID_MASK);
+	return 0;
 }
 
-static void litevm_try_inject_irq(struct litevm_vcpu *vcpu)
+static void replay_put(struct litevm_vcpu *vcpu,
+		       struct litevm_replay_record *rec)
 {
-	if ((vmcs_readl(GUEST_RFLAGS) & X86_EFLAGS_IF)
-	    && (vmcs_read32(GUEST_INTERRUPTIBILITY_INFO) & 3) == 0)
-		/*
-		 * Interrupts enabled, and not blocked by sti or mov ss. Good.
-		 */
-		litevm_do_inject_irq(vcpu);
-	else
-		/*
-		 * Interrupts blocked.  Wait for unblock.
-		 */
-		vmcs_write32(CPU_BASED_VM_EXEC_CONTROL,
-			     vmcs_read32(CPU_BASED_VM_EXEC_CONTROL)
-			     | CPU_BASED_VIRTUAL_INTR_PENDING);
+	struct litevm_replay_record *p;
+
+	p = litevm_ring_reserve(&vcpu->replay_ring);
+	if (!p)
+		return;
+	*p = *rec;
+	litevm_ring_commit(&vcpu->replay_ring);
 }
 
-static void litevm_guest_debug_pre(struct litevm_vcpu *vcpu)
+/*
+ * Recording: the exit goes to userspace; its record goes in the ring
+ * when the next run brings the completion.
+ */
+static void replay_note_exit(struct litevm_vcpu *vcpu,
+			     struct litevm_run *litevm_run)
 {
-	struct litevm_guest_debug *dbg = &vcpu->guest_debug;
-
-	set_debugreg(dbg->bp[0], 0);
-	set_debugreg(dbg->bp[1], 1);
-	set_debugreg(dbg->bp[2], 2);
-	set_debugreg(dbg->bp[3], 3);
-
-	if (dbg->singlestep) {
-		unsigned long flags;
-
-		flags = vmcs_readl(GUEST_RFLAGS);
-		flags |= X86_EFLAGS_TF | X86_EFLAGS_RF;
-		vmcs_writel(GUEST_RFLAGS, flags);
+	struct litevm_replay_record *rec = &vcpu->replay_exit;
+
+	memset(rec, 0, sizeof *rec);
+	rec->rip = vcpu_vmcs_readl(vcpu, VCPU_VMCS_RIP);
+	rec->exit_reason = litevm_run->exit_reason;
+	rec->key = replay_key(litevm_run);
+	if (litevm_run->exit_reason == LITEVM_EXIT_IO) {
+		if (litevm_run->io.string)
+			rec->flags |= LITEVM_REPLAY_STRING;
+		else if (litevm_run->io.direction == LITEVM_EXIT_IO_IN)
+			rec->flags |= LITEVM_REPLAY_IO_IN;
 	}
+	vcpu->replay_pending = 1;
 }
 
-static void load_msrs(struct vmx_msr_entry *e, int n)
+static void replay_note_completion(struct litevm_vcpu *vcpu,
+				   struct litevm_run *litevm_run)
 {
-	int i;
+	struct litevm_replay_record *rec = &vcpu->replay_exit;
 
-	for (i = 0; i < n; ++i)
-		wrmsrl(e[i].index, e[i].data);
+	if (litevm_run->emulated)
+		rec->flags |= LITEVM_REPLAY_EMULATED;
+	if (rec->flags & LITEVM_REPLAY_IO_IN)
+		rec->data = vcpu->regs[VCPU_REGS_RAX];
+	if (litevm_run->mmio_completed) {
+		rec->flags |= LITEVM_REPLAY_MMIO_COMPLETED;
+		memcpy(&rec->data, litevm_run->mmio.data, 8);
+	}
+	if (vcpu->msr_exit) {
+		if (litevm_run->msr.error)
+			rec->flags |= LITEVM_REPLAY_MSR_ERROR;
+		rec->data = litevm_run->msr.data;
+	}
+	replay_put(vcpu, rec);
+	vcpu->replay_pending = 0;
 }
 
-static void save_msrs(struct vmx_msr_entry *e, int n)
+/*
+ * Replaying: complete the exit from the next record instead of going to
+ * userspace.  Returns 1 if it did.  Otherwise replay is over and the
+ * exit goes out as usual.
+ */
+static int replay_exit(struct litevm_vcpu *vcpu, struct litevm_run *litevm_run)
 {
-	int i;
+	struct litevm_replay_record *rec;
+
+	replay_irqs(vcpu);
+	if (vcpu->replay_pos == vcpu->replay_len)
+		goto stop;
+	rec = &vcpu->replay[vcpu->replay_pos];
+	if (rec->exit_reason != litevm_run->exit_reason
+	    || rec->key != replay_key(litevm_run)
+	    || rec->rip != vcpu_vmcs_readl(vcpu, VCPU_VMCS_RIP)) {
+		++vcpu->stat->replay_diverged;
+		goto stop;
+	}
+	++vcpu->replay_pos;
+	/* userspace moves the data of string i/o; replay carries on after */
+	if (rec->flags & LITEVM_REPLAY_STRING)
+		return 0;
 
-	for (i = 0; i < n; ++i)
-		rdmsrl(e[i].index, e[i].data);
+	litevm_run->emulated = (rec->flags & LITEVM_REPLAY_EMULATED) != 0;
+	if (rec->flags & LITEVM_REPLAY_IO_IN)
+		vcpu->regs[VCPU_REGS_RAX] = rec->data;
+	litevm_run->mmio_completed =
+		(rec->flags & LITEVM_REPLAY_MMIO_COMPLETED) != 0;
+	if (litevm_run->mmio_completed)
+		memcpy(litevm_run->mmio.data, &rec->data, 8);
+	if (vcpu->msr_exit) {
+		litevm_run->msr.error = (rec->flags & LITEVM_REPLAY_MSR_ERROR) != 0;
+		litevm_run->msr.data = rec->data;
+	}
+	complete_user_exit(vcpu, litevm_run);
+	litevm_run->mmio_completed = 0;
+	++vcpu->stat->replay_exits;
+	return 1;
+
+stop:
+	/* the records are freed by the next LITEVM_SET_REPLAY, or with us */
+	vcpu->replay_mode = LITEVM_REPLAY_OFF;
+	return 0;
 }
 
-static int litevm_dev_ioctl_run(struct litevm *litevm, struct litevm_run *litevm_run)
+/*
+ * Runs the vcpu in slot n.  With a NULL litevm_run, the vcpu's own
+ * run page (which userspace has mapped) is used, so nothing gets copied.
+ */
+static int litevm_dev_ioctl_run(struct litevm *litevm, int n,
+				struct litevm_run *litevm_run)
 {
 	struct litevm_vcpu *vcpu;
 	u8 fail;
-	u16 fs_sel, gs_sel, ldt_sel;
-	int fs_gs_ldt_reload_needed;
 
-	if (litevm_run->vcpu < 0 || litevm_run->vcpu >= LITEVM_MAX_VCPUS)
+	if (n < 0 || n >= LITEVM_MAX_VCPUS)
 		return -EINVAL;
 
-	vcpu = vcpu_load(litevm, litevm_run->vcpu);
+	vcpu = vcpu_load(litevm, n);
 	if (!vcpu)
 		return -ENOENT;
 
-	if (litevm_run->emulated) {
-		skip_emulated_instruction(vcpu);
-		litevm_run->emulated = 0;
-	}
+	if (!litevm_run)
+		litevm_run = vcpu->run;
 
-	if (litevm_run->mmio_completed) {
-		memcpy(vcpu->mmio_data, litevm_run->mmio.data, 8);
-		vcpu->mmio_read_completed = 1;
+	if (vcpu->user_exit_tsc)
+		account_user_exit(vcpu);
+
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+	if (unlikely(vcpu->pid != task_pid(current))) {
+		struct pid *old = vcpu->pid;
+
+		rcu_assign_pointer(vcpu->pid, get_pid(task_pid(current)));
+		synchronize_rcu();
+		put_pid(old);
 	}
+#endif
 
-	vcpu->mmio_needed = 0;
+	if (vcpu->replay_pending)
+		replay_note_completion(vcpu, litevm_run);
+	complete_user_exit(vcpu, litevm_run);
+
+	vcpu->budget_deadline = 0;
+	if (vcpu->cycle_budget) {
+		u64 now;
+
+		rdtscll(now);
+		vcpu->budget_deadline = now + vcpu->cycle_budget;
+	}
+	/* without the timer, samples wait for exits that happen anyway */
+	set_preemption_timer(vcpu, vmx_preemption_timer_shift >= 0
+			     && (vcpu->budget_deadline || vcpu->sample_period));
 
 again:
 	/*
-	 * Set host fs and gs selectors.  Unfortunately, 22.2.3 does not
-	 * allow segment selectors with cpl > 0 or ti == 1.
+	 * From here until the exit has been taken, the host state we set
+	 * up must stay on this cpu.  The preemption timer is armed in here
+	 * too, or time spent preempted would come on top of the budget.
 	 */
-	fs_sel = read_fs();
-	gs_sel = read_gs();
-	ldt_sel = read_ldt();
-	fs_gs_ldt_reload_needed = (fs_sel & 7) | (gs_sel & 7) | ldt_sel;
-	if (!fs_gs_ldt_reload_needed) {
-		vmcs_write16(HOST_FS_SELECTOR, fs_sel);
-		vmcs_write16(HOST_GS_SELECTOR, gs_sel);
-	} else {
-		vmcs_write16(HOST_FS_SELECTOR, 0);
-		vmcs_write16(HOST_GS_SELECTOR, 0);
+	preempt_disable();
+	if (vcpu->preemption_timer && litevm_arm_preemption_timer(vcpu)) {
+		preempt_enable();
+		litevm_run->exit_type = LITEVM_EXIT_TYPE_VM_EXIT;
+		litevm_run->exit_reason = LITEVM_EXIT_BUDGET;
+		note_user_exit(vcpu, litevm_run);
+		vcpu_put(vcpu);
+		return 0;
 	}
+	litevm_save_host_state(vcpu);
 
-#ifdef __x86_64__
-	vmcs_writel(HOST_FS_BASE, read_msr(MSR_FS_BASE));
-	vmcs_writel(HOST_GS_BASE, read_msr(MSR_GS_BASE));
-#endif
+	/*
+	 * An irq raised after we look at irq_summary sees guest_mode and
+	 * sends an ipi; with interrupts off it stays pending over the entry
+	 * and brings the guest straight back out.
+	 */
+	local_irq_disable();
+	vcpu->guest_mode = 1;
+	smp_mb();
 
 	if (vcpu->irq_summary &&
 	    !(vmcs_read32(VM_ENTRY_INTR_INFO_FIELD) & INTR_INFO_VALID_MASK))
 		litevm_try_inject_irq(vcpu);
 
+	if (vcpu->vapic)
+		update_tpr_threshold(vcpu);
+
 	if (vcpu->guest_debug.enabled)
 		litevm_guest_debug_pre(vcpu);
 
-	fx_save(vcpu->host_fx_image);
-	fx_restore(vcpu->guest_fx_image);
+	litevm_load_guest_msrs(vcpu);
+	vcpu_vmcs_flush(vcpu);
+	trace_litevm_entry(vcpu);
 
-	save_msrs(vcpu->host_msrs, vcpu->nmsrs);
-	load_msrs(vcpu->guest_msrs, NR_BAD_MSRS);
+	/*
+	 * The host's fpu tracking doesn't know about the guest state, so
+	 * it is only in the registers while interrupts are off.
+	 */
+	if (vcpu->fpu_active) {
+		fx_save(vcpu->host_fx_image);
+		fx_restore(vcpu->guest_fx_image);
+	}
 
 	asm (
 		/* Store host registers */
@@ -2745,55 +4728,63 @@ again:
 		[cr2]"i"(offsetof(struct litevm_vcpu, cr2))
 	      : "cc", "memory" );
 
-	++litevm_stat.exits;
-
-	save_msrs(vcpu->guest_msrs, NR_BAD_MSRS);
-	load_msrs(vcpu->host_msrs, NR_BAD_MSRS);
+	if (vcpu->fpu_active) {
+		fx_save(vcpu->guest_fx_image);
+		fx_restore(vcpu->host_fx_image);
+	}
 
-	fx_save(vcpu->guest_fx_image);
-	fx_restore(vcpu->host_fx_image);
+	++vcpu->stat->exits;
+	vcpu->vmcs_cache_avail = 0;	/* the cpu may have changed any of them */
+	if (vcpu->mmu.ept)
+		vcpu->cr3 = vmcs_readl(GUEST_CR3);	/* loads don't exit */
+	if (vcpu->vapic)
+		vcpu->cr8 = vcpu->vapic[VAPIC_TPR] >> 4;
 
 #ifndef __x86_64__
 	asm ("mov %0, %%ds; mov %0, %%es" : : "r"(__USER_DS));
 #endif
+	vcpu->guest_mode = 0;
+	local_irq_enable();
+	preempt_enable();
 
 	litevm_run->exit_type = 0;
 	if (fail) {
 		litevm_run->exit_type = LITEVM_EXIT_TYPE_FAIL_ENTRY;
 		litevm_run->exit_reason = vmcs_read32(VM_INSTRUCTION_ERROR);
 	} else {
-		if (fs_gs_ldt_reload_needed) {
-			load_ldt(ldt_sel);
-			load_fs(fs_sel);
-			/*
-			 * If we have to reload gs, we must take care to
-			 * preserve our gs base.
-			 */
-			local_irq_disable();
-			load_gs(gs_sel);
-#ifdef __x86_64__
-			wrmsrl(MSR_GS_BASE, vmcs_readl(HOST_GS_BASE));
-#endif
-			local_irq_enable();
-
-			reload_tss();
-		}
 		vcpu->launched = 1;
 		litevm_run->exit_type = LITEVM_EXIT_TYPE_VM_EXIT;
-		if (litevm_handle_exit(litevm_run, vcpu)) {
-			/* Give scheduler a change to reschedule. */
-			vcpu_put(vcpu);
+		/* a replayed exit is as good as one handled in the kernel */
+		if (litevm_handle_exit(litevm_run, vcpu)
+		    || (vcpu->replay_mode == LITEVM_REPLAY_PLAY
+			&& replay_exit(vcpu, litevm_run))) {
+			/*
+			 * Stay loaded for the next entry unless someone
+			 * actually wants this thread or this cpu.
+			 */
 			if (signal_pending(current)) {
-				++litevm_stat.signal_exits;
+				++vcpu->stat->signal_exits;
+				vcpu_put(vcpu);
 				return -EINTR;
 			}
-			cond_resched();
-			/* Cannot fail -  no vcpu unplug yet. */
-			vcpu_load(litevm, vcpu_slot(vcpu));
+			if (need_resched()) {
+				/* Give scheduler a chance to reschedule. */
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+				cond_resched();
+#else
+				vcpu_put(vcpu);
+				cond_resched();
+				/* Cannot fail -  no vcpu unplug yet. */
+				vcpu_load(litevm, vcpu_slot(vcpu));
+#endif
+			}
 			goto again;
 		}
+		if (vcpu->replay_mode == LITEVM_REPLAY_RECORD)
+			replay_note_exit(vcpu, litevm_run);
 	}
 
+	note_user_exit(vcpu, litevm_run);
 	vcpu_put(vcpu);
 	return 0;
 }
@@ -2815,7 +4806,7 @@ static int litevm_dev_ioctl_get_regs(struct litevm *litevm, struct litevm_regs *
 	regs->rdx = vcpu->regs[VCPU_REGS_RDX];
 	regs->rsi = vcpu->regs[VCPU_REGS_RSI];
 	regs->rdi = vcpu->regs[VCPU_REGS_RDI];
-	regs->rsp = vmcs_readl(GUEST_RSP);
+	regs->rsp = vcpu_vmcs_readl(vcpu, VCPU_VMCS_RSP);
 	regs->rbp = vcpu->regs[VCPU_REGS_RBP];
 #ifdef __x86_64__
 	regs->r8 = vcpu->regs[VCPU_REGS_R8];
@@ -2828,8 +4819,8 @@ static int litevm_dev_ioctl_get_regs(struct litevm *litevm, struct litevm_regs *
 	regs->r15 = vcpu->regs[VCPU_REGS_R15];
 #endif
 
-	regs->rip = vmcs_readl(GUEST_RIP);
-	regs->rflags = vmcs_readl(GUEST_RFLAGS);
+	regs->rip = vcpu_vmcs_readl(vcpu, VCPU_VMCS_RIP);
+	regs->rflags = vcpu_vmcs_readl(vcpu, VCPU_VMCS_RFLAGS);
 
 	/*
 	 * Don't leak debug flags in case they were set for guest debugging
@@ -2859,7 +4850,7 @@ static int litevm_dev_ioctl_set_regs(struct litevm *litevm, struct litevm_regs *
 	vcpu->regs[VCPU_REGS_RDX] = regs->rdx;
 	vcpu->regs[VCPU_REGS_RSI] = regs->rsi;
 	vcpu->regs[VCPU_REGS_RDI] = regs->rdi;
-	vmcs_writel(GUEST_RSP, regs->rsp);
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_RSP, regs->rsp);
 	vcpu->regs[VCPU_REGS_RBP] = regs->rbp;
 #ifdef __x86_64__
 	vcpu->regs[VCPU_REGS_R8] = regs->r8;
@@ -2872,8 +4863,8 @@ static int litevm_dev_ioctl_set_regs(struct litevm *litevm, struct litevm_regs *
 	vcpu->regs[VCPU_REGS_R15] = regs->r15;
 #endif
 
-	vmcs_writel(GUEST_RIP, regs->rip);
-	vmcs_writel(GUEST_RFLAGS, regs->rflags);
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_RIP, regs->rip);
+	vcpu_vmcs_writel(vcpu, VCPU_VMCS_RFLAGS, regs->rflags);
 
 	vcpu_put(vcpu);
 
@@ -2929,10 +4920,10 @@ static int litevm_dev_ioctl_get_sregs(struct litevm *litevm, struct litevm_sregs
 	get_dtable(gdt, GDTR);
 #undef get_dtable
 
-	sregs->cr0 = guest_cr0();
+	sregs->cr0 = guest_cr0(vcpu);
 	sregs->cr2 = vcpu->cr2;
 	sregs->cr3 = vcpu->cr3;
-	sregs->cr4 = guest_cr4();
+	sregs->cr4 = guest_cr4(vcpu);
 	sregs->cr8 = vcpu->cr8;
 	sregs->efer = vcpu->shadow_efer;
 	sregs->apic_base = vcpu->apic_base;
@@ -3001,7 +4992,7 @@ static int litevm_dev_ioctl_set_sregs(struct litevm *litevm, struct litevm_sregs
 	mmu_reset_needed |= vcpu->cr3 != sregs->cr3;
 	vcpu->cr3 = sregs->cr3;
 
-	vcpu->cr8 = sregs->cr8;
+	__set_cr8(vcpu, sregs->cr8);
 
 	mmu_reset_needed |= vcpu->shadow_efer != sregs->efer;
 #ifdef __x86_64__
@@ -3009,17 +5000,16 @@ static int litevm_dev_ioctl_set_sregs(struct litevm *litevm, struct litevm_sregs
 #endif
 	vcpu->apic_base = sregs->apic_base;
 
-	mmu_reset_needed |= guest_cr0() != sregs->cr0;
+	mmu_reset_needed |= guest_cr0(vcpu) != sregs->cr0;
 	vcpu->rmode.active = ((sregs->cr0 & CR0_PE_MASK) == 0);
 	update_exception_bitmap(vcpu);
-	vmcs_writel(CR0_READ_SHADOW, sregs->cr0);
-	vmcs_writel(GUEST_CR0, sregs->cr0 | LITEVM_VM_CR0_ALWAYS_ON);
+	set_guest_cr0(vcpu, sregs->cr0);
 
-	mmu_reset_needed |=  guest_cr4() != sregs->cr4;
+	mmu_reset_needed |=  guest_cr4(vcpu) != sregs->cr4;
 	__set_cr4(vcpu, sregs->cr4);
 
 	if (mmu_reset_needed)
-		litevm_mmu_reset_context(vcpu);
+		litevm_mmu_mode_changed(vcpu);
 	vcpu_put(vcpu);
 
 	return 0;
@@ -3049,6 +5039,144 @@ static int litevm_dev_ioctl_translate(struct litevm *litevm, struct litevm_trans
 	return 0;
 }
 
+static int litevm_dev_ioctl_set_cycle_budget(struct litevm *litevm,
+					     struct litevm_cycle_budget *budget)
+{
+	struct litevm_vcpu *vcpu;
+
+	if (budget->vcpu < 0 || budget->vcpu >= LITEVM_MAX_VCPUS)
+		return -EINVAL;
+	if (budget->cycles && vmx_preemption_timer_shift < 0)
+		return -EINVAL;
+	vcpu = vcpu_load(litevm, budget->vcpu);
+	if (!vcpu)
+		return -ENOENT;
+	vcpu->cycle_budget = budget->cycles;
+	vcpu_put(vcpu);
+	return 0;
+}
+
+static int litevm_dev_ioctl_set_sampling(struct litevm *litevm,
+					 struct litevm_sampling *sampling)
+{
+	struct litevm_vcpu *vcpu;
+	int r = 0;
+
+	if (sampling->vcpu < 0 || sampling->vcpu >= LITEVM_MAX_VCPUS)
+		return -EINVAL;
+	/*
+	 * Only the mutex: a loaded vcpu may have preemption off, and the
+	 * ring allocation can sleep.
+	 */
+	vcpu = &litevm->vcpus[sampling->vcpu];
+	mutex_lock(&vcpu->mutex);
+	if (!vcpu->vmcs) {
+		mutex_unlock(&vcpu->mutex);
+		return -ENOENT;
+	}
+
+	if (sampling->period_us && !vcpu->sample_ring.hdr)
+		r = litevm_ring_init(&vcpu->sample_ring,
+				     sizeof(struct litevm_rip_sample));
+	if (!r) {
+		vcpu->sample_period = (u64)sampling->period_us * tsc_khz / 1000;
+		if (sampling->period_us && !vcpu->sample_period)
+			vcpu->sample_period = 1;
+		rdtscll(vcpu->next_sample);
+		vcpu->next_sample += vcpu->sample_period;
+	}
+
+	mutex_unlock(&vcpu->mutex);
+	return r;
+}
+
+static int litevm_dev_ioctl_set_replay(struct litevm *litevm,
+				       struct litevm_replay *replay)
+{
+	struct litevm_vcpu *vcpu;
+	struct litevm_replay_record *records = 0, *old;
+	u32 nrecords = 0;
+	int r = 0;
+
+	if (replay->vcpu < 0 || replay->vcpu >= LITEVM_MAX_VCPUS)
+		return -EINVAL;
+	if (replay->mode > LITEVM_REPLAY_PLAY)
+		return -EINVAL;
+	if (replay->mode == LITEVM_REPLAY_PLAY) {
+		nrecords = replay->nrecords;
+		if (!nrecords || nrecords > LITEVM_MAX_REPLAY_RECORDS)
+			return -EINVAL;
+		records = vmalloc(nrecords * sizeof *records);
+		if (!records)
+			return -ENOMEM;
+		if (copy_from_user(records, (void *)(unsigned long)replay->records,
+				   nrecords * sizeof *records)) {
+			vfree(records);
+			return -EFAULT;
+		}
+	}
+
+	/* as for sampling, the ring allocation may sleep */
+	vcpu = &litevm->vcpus[replay->vcpu];
+	mutex_lock(&vcpu->mutex);
+	if (!vcpu->vmcs) {
+		r = -ENOENT;
+		goto out;
+	}
+	if (replay->mode == LITEVM_REPLAY_RECORD && !vcpu->replay_ring.hdr) {
+		r = litevm_ring_init(&vcpu->replay_ring,
+				     sizeof(struct litevm_replay_record));
+		if (r)
+			goto out;
+	}
+	old = vcpu->replay;
+	vcpu->replay = records;
+	records = old;
+	vcpu->replay_pos = 0;
+	vcpu->replay_len = nrecords;
+	vcpu->replay_pending = 0;
+	vcpu->replay_mode = replay->mode;
+	if (replay->mode == LITEVM_REPLAY_PLAY)
+		replay_irqs(vcpu);	/* raised before the first run */
+out:
+	mutex_unlock(&vcpu->mutex);
+	vfree(records);
+	return r;
+}
+
+static void litevm_kick_ipi(void *info)
+{
+	/* the interrupt itself is the point: the guest exits to take it */
+}
+
+/*
+ * Get a vcpu to notice a newly raised irq: wake it from halt, or push
+ * it out of the guest if it's in there on another cpu.
+ */
+static void litevm_vcpu_kick(struct litevm_vcpu *vcpu)
+{
+	int me, cpu;
+
+	smp_mb();	/* irq_pending before wq and guest_mode */
+	if (waitqueue_active(&vcpu->wq)) {
+		vcpu->wakeup_time = ktime_get();
+		wake_up_interruptible(&vcpu->wq);
+	}
+	me = get_cpu();
+	if (ACCESS_ONCE(vcpu->guest_mode)) {
+		smp_rmb();
+		cpu = ACCESS_ONCE(vcpu->cpu);
+		if (cpu != me && cpu >= 0)
+			smp_call_function_single(cpu, litevm_kick_ipi, 0, 0);
+	}
+	put_cpu();
+}
+
+/*
+ * Runs without the vcpu mutex, so an i/o thread needn't wait for the
+ * vcpu to leave the run loop.  Recording a replay still takes it, as the
+ * record must come from whoever owns the ring.
+ */
 static int litevm_dev_ioctl_interrupt(struct litevm *litevm, struct litevm_interrupt *irq)
 {
 	struct litevm_vcpu *vcpu;
@@ -3057,14 +5185,33 @@ static int litevm_dev_ioctl_interrupt(struct litevm *litevm, struct litevm_inter
 		return -EINVAL;
 	if (irq->irq < 0 || irq->irq >= 256)
 		return -EINVAL;
-	vcpu = vcpu_load(litevm, irq->vcpu);
-	if (!vcpu)
+	vcpu = &litevm->vcpus[irq->vcpu];
+	if (!ACCESS_ONCE(vcpu->vmcs))
 		return -ENOENT;
 
+	if (ACCESS_ONCE(vcpu->replay_mode) == LITEVM_REPLAY_RECORD) {
+		vcpu = vcpu_load(litevm, irq->vcpu);
+		if (!vcpu)
+			return -ENOENT;
+		if (vcpu->replay_mode == LITEVM_REPLAY_RECORD) {
+			struct litevm_replay_record rec = {
+				.rip = vcpu_vmcs_readl(vcpu, VCPU_VMCS_RIP),
+				.key = irq->irq,
+				.flags = LITEVM_REPLAY_IRQ,
+			};
+
+			replay_put(vcpu, &rec);
+		}
+		set_bit(irq->irq, vcpu->irq_pending);
+		set_bit(irq->irq / BITS_PER_LONG, &vcpu->irq_summary);
+		litevm_vcpu_kick(vcpu);
+		vcpu_put(vcpu);
+		return 0;
+	}
+
 	set_bit(irq->irq, vcpu->irq_pending);
 	set_bit(irq->irq / BITS_PER_LONG, &vcpu->irq_summary);
-
-	vcpu_put(vcpu);
+	litevm_vcpu_kick(vcpu);
 
 	return 0;
 }
@@ -3074,7 +5221,6 @@ static int litevm_dev_ioctl_debug_guest(struct litevm *litevm,
 {
 	struct litevm_vcpu *vcpu;
 	unsigned long dr7 = 0x400;
-	u32 exception_bitmap;
 	int old_singlestep;
 
 	if (dbg->vcpu < 0 || dbg->vcpu >= LITEVM_MAX_VCPUS)
@@ -3083,7 +5229,6 @@ static int litevm_dev_ioctl_debug_guest(struct litevm *litevm,
 	if (!vcpu)
 		return -ENOENT;
 
-	exception_bitmap = vmcs_read32(EXCEPTION_BITMAP);
 	old_singlestep = vcpu->guest_debug.singlestep;
 
 	vcpu->guest_debug.enabled = dbg->enabled;
@@ -3099,23 +5244,20 @@ static int litevm_dev_ioctl_debug_guest(struct litevm *litevm,
 			dr7 |= 0 << (i*4+16); /* execution breakpoint */
 		}
 
-		exception_bitmap |= (1u << 1);  /* Trap debug exceptions */
-
 		vcpu->guest_debug.singlestep = dbg->singlestep;
 	} else {
-		exception_bitmap &= ~(1u << 1); /* Ignore debug exceptions */
 		vcpu->guest_debug.singlestep = 0;
 	}
 
 	if (old_singlestep && !vcpu->guest_debug.singlestep) {
 		unsigned long flags;
 
-		flags = vmcs_readl(GUEST_RFLAGS);
+		flags = vcpu_vmcs_readl(vcpu, VCPU_VMCS_RFLAGS);
 		flags &= ~(X86_EFLAGS_TF | X86_EFLAGS_RF);
-		vmcs_writel(GUEST_RFLAGS, flags);
+		vcpu_vmcs_writel(vcpu, VCPU_VMCS_RFLAGS, flags);
 	}
 
-	vmcs_write32(EXCEPTION_BITMAP, exception_bitmap);
+	update_exception_bitmap(vcpu); /* traps debug exceptions if enabled */
 	vmcs_writel(GUEST_DR7, dr7);
 
 	vcpu_put(vcpu);
@@ -3142,7 +5284,7 @@ static long litevm_dev_ioctl(struct file *filp,
 		r = -EFAULT;
 		if (copy_from_user(&litevm_run, (void *)arg, sizeof litevm_run))
 			goto out;
-		r = litevm_dev_ioctl_run(litevm, &litevm_run);
+		r = litevm_dev_ioctl_run(litevm, litevm_run.vcpu, &litevm_run);
 		if (r < 0)
 			goto out;
 		r = -EFAULT;
@@ -3151,6 +5293,13 @@ static long litevm_dev_ioctl(struct file *filp,
 		r = 0;
 		break;
 	}
+	case LITEVM_RUN_VCPU: {
+		r = litevm_dev_ioctl_run(litevm, arg, NULL);
+		if (r < 0)
+			goto out;
+		r = 0;
+		break;
+	}
 	case LITEVM_GET_REGS: {
 		struct litevm_regs litevm_regs;
 
@@ -3232,6 +5381,39 @@ static long litevm_dev_ioctl(struct file *filp,
 		r = 0;
 		break;
 	}
+	case LITEVM_SET_CYCLE_BUDGET: {
+		struct litevm_cycle_budget budget;
+
+		r = -EFAULT;
+		if (copy_from_user(&budget, (void *)arg, sizeof budget))
+			goto out;
+		r = litevm_dev_ioctl_set_cycle_budget(litevm, &budget);
+		if (r)
+			goto out;
+		break;
+	}
+	case LITEVM_SET_SAMPLING: {
+		struct litevm_sampling sampling;
+
+		r = -EFAULT;
+		if (copy_from_user(&sampling, (void *)arg, sizeof sampling))
+			goto out;
+		r = litevm_dev_ioctl_set_sampling(litevm, &sampling);
+		if (r)
+			goto out;
+		break;
+	}
+	case LITEVM_SET_REPLAY: {
+		struct litevm_replay replay;
+
+		r = -EFAULT;
+		if (copy_from_user(&replay, (void *)arg, sizeof replay))
+			goto out;
+		r = litevm_dev_ioctl_set_replay(litevm, &replay);
+		if (r)
+			goto out;
+		break;
+	}
 	case LITEVM_DEBUG_GUEST: {
 		struct litevm_debug_guest dbg;
 
@@ -3255,6 +5437,28 @@ static long litevm_dev_ioctl(struct file *filp,
 			goto out;
 		break;
 	}
+	case LITEVM_SET_MSR_POLICY: {
+		struct litevm_msr_policy policy;
+
+		r = -EFAULT;
+		if (copy_from_user(&policy, (void *)arg, sizeof policy))
+			goto out;
+		r = litevm_set_msr_policy(litevm, policy.index, policy.policy);
+		if (r)
+			goto out;
+		break;
+	}
+	case LITEVM_SET_IO_POLICY: {
+		struct litevm_io_policy policy;
+
+		r = -EFAULT;
+		if (copy_from_user(&policy, (void *)arg, sizeof policy))
+			goto out;
+		r = litevm_dev_ioctl_set_io_policy(litevm, &policy);
+		if (r)
+			goto out;
+		break;
+	}
 	case LITEVM_GET_DIRTY_LOG: {
 		struct litevm_dirty_log log;
 
@@ -3273,12 +5477,84 @@ out:
 	return r;
 }
 
+static struct page *litevm_run_page(struct litevm *litevm, unsigned long pgoff)
+{
+	unsigned long n = pgoff - LITEVM_RUN_PAGE_PGOFF;
+	struct litevm_run *run;
+
+	if (n >= LITEVM_MAX_VCPUS)
+		return NULL;
+	/*
+	 * No vcpu mutex: LITEVM_RUN_VCPU holds it while the guest runs.
+	 * The page doesn't change while the vcpu exists.
+	 */
+	run = ACCESS_ONCE(litevm->vcpus[n].run);
+	if (!run)
+		return NULL;
+	return virt_to_page(run);
+}
+
+/*
+ * Page n of the rings at ring_offset in the vcpus, LITEVM_RING_PAGES
+ * for each vcpu in turn.  Without the vcpu mutex, which the vcpu thread
+ * holds for as long as the guest runs: a ring, once there, stays until
+ * the vm goes.
+ */
+static struct page *litevm_vcpu_ring_page(struct litevm *litevm,
+					  unsigned long n, size_t ring_offset)
+{
+	struct litevm_vcpu *vcpu;
+
+	if (n / LITEVM_RING_PAGES >= LITEVM_MAX_VCPUS)
+		return NULL;
+	vcpu = &litevm->vcpus[n / LITEVM_RING_PAGES];
+	return litevm_ring_page((void *)vcpu + ring_offset,
+				n % LITEVM_RING_PAGES);
+}
+
 static int litevm_dev_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 {
 	struct litevm *litevm = vma->vm_file->private_data;
 	struct litevm_memory_slot *slot;
 	struct page *page;
 
+	if (vmf->pgoff >= LITEVM_REPLAY_RING_PGOFF
+	    && vmf->pgoff < LITEVM_STATS_PAGE_PGOFF) {
+		if (vmf->pgoff < LITEVM_EXIT_RING_PGOFF)
+			page = litevm_vcpu_ring_page(litevm,
+				vmf->pgoff - LITEVM_REPLAY_RING_PGOFF,
+				offsetof(struct litevm_vcpu, replay_ring));
+		else if (vmf->pgoff < LITEVM_SAMPLE_RING_PGOFF)
+			page = litevm_vcpu_ring_page(litevm,
+				vmf->pgoff - LITEVM_EXIT_RING_PGOFF,
+				offsetof(struct litevm_vcpu, exit_ring));
+		else
+			page = litevm_vcpu_ring_page(litevm,
+				vmf->pgoff - LITEVM_SAMPLE_RING_PGOFF,
+				offsetof(struct litevm_vcpu, sample_ring));
+		if (!page)
+			return VM_FAULT_SIGBUS;
+		get_page(page);
+		vmf->page = page;
+		return 0;
+	}
+
+	if (vmf->pgoff == LITEVM_STATS_PAGE_PGOFF) {
+		page = virt_to_page(litevm->stats_page);
+		get_page(page);
+		vmf->page = page;
+		return 0;
+	}
+
+	if (vmf->pgoff >= LITEVM_RUN_PAGE_PGOFF) {
+		page = litevm_run_page(litevm, vmf->pgoff);
+		if (!page)
+			return VM_FAULT_SIGBUS;
+		get_page(page);
+		vmf->page = page;
+		return 0;
+	}
+
 	slot = gfn_to_memslot(litevm, vmf->pgoff);
 	if (!slot)
 		return VM_FAULT_SIGBUS;
@@ -3297,6 +5573,13 @@ static struct vm_operations_struct litevm_dev_vm_ops = {
 
 static int litevm_dev_mmap(struct file *file, struct vm_area_struct *vma)
 {
+	/* the counters are the vcpus' to write */
+	if (vma->vm_pgoff <= LITEVM_STATS_PAGE_PGOFF
+	    && vma->vm_pgoff + vma_pages(vma) > LITEVM_STATS_PAGE_PGOFF) {
+		if (vma->vm_flags & VM_WRITE)
+			return -EPERM;
+		vma->vm_flags &= ~VM_MAYWRITE;
+	}
 	vma->vm_ops = &litevm_dev_vm_ops;
 	return 0;
 }
@@ -3341,8 +5624,8 @@ static __init void litevm_init_debug(void)
 
 	debugfs_dir = debugfs_create_dir("litevm", 0);
 	for (p = debugfs_entries; p->name; ++p)
-		p->dentry = debugfs_create_u32(p->name, 0444, debugfs_dir,
-					       p->data);
+		p->dentry = debugfs_create_file(p->name, 0444, debugfs_dir, p,
+						&global_stat_fops);
 }
 
 static void litevm_exit_debug(void)
@@ -3373,6 +5656,11 @@ static __init int litevm_init(void)
 	litevm_init_debug();
 
 	setup_vmcs_descriptor();
+	setup_vpid();
+	setup_ept();
+	setup_tpr_shadow();
+	setup_preemption_timer();
+	setup_ple();
 	r = alloc_litevm_area();
 	if (r)
 		goto out;
@@ -0,0 +1,176 @@
+/*
+ * Trace events for the exit, entry, fault and emulation paths, for ftrace
+ * and perf.  The events are defined once, in litevm_main.c.
+ */
+
+#if !defined(_LITEVM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LITEVM_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM litevm
+
+/* outcomes of the shadow page fault handler, see FNAME(page_fault) */
+#define LITEVM_PF_FIXED   0	/* shadow pte filled in */
+#define LITEVM_PF_GUEST   1	/* reflected to the guest */
+#define LITEVM_PF_MMIO    2	/* needs emulation */
+
+TRACE_EVENT(litevm_entry,
+	TP_PROTO(struct litevm_vcpu *vcpu),
+	TP_ARGS(vcpu),
+
+	TP_STRUCT__entry(
+		__field(	int,		vcpu		)
+	),
+
+	TP_fast_assign(
+		__entry->vcpu = vcpu - vcpu->litevm->vcpus;
+	),
+
+	TP_printk("vcpu %d", __entry->vcpu)
+);
+
+/* rip and qualification are only read from the vmcs when tracing */
+TRACE_EVENT(litevm_exit,
+	TP_PROTO(struct litevm_vcpu *vcpu, u32 exit_reason),
+	TP_ARGS(vcpu, exit_reason),
+
+	TP_STRUCT__entry(
+		__field(	int,		vcpu		)
+		__field(	u32,		exit_reason	)
+		__field(	unsigned long,	rip		)
+		__field(	unsigned long,	qual		)
+	),
+
+	TP_fast_assign(
+		__entry->vcpu = vcpu - vcpu->litevm->vcpus;
+		__entry->exit_reason = exit_reason;
+		__entry->rip = vmcs_readl(GUEST_RIP);
+		__entry->qual = vmcs_readl(EXIT_QUALIFICATION);
+	),
+
+	TP_printk("vcpu %d reason %u rip 0x%lx qual 0x%lx",
+		  __entry->vcpu, __entry->exit_reason, __entry->rip,
+		  __entry->qual)
+);
+
+TRACE_EVENT(litevm_page_fault,
+	TP_PROTO(gva_t gva, u32 error_code, int outcome),
+	TP_ARGS(gva, error_code, outcome),
+
+	TP_STRUCT__entry(
+		__field(	gva_t,		gva		)
+		__field(	u32,		error_code	)
+		__field(	int,		outcome		)
+	),
+
+	TP_fast_assign(
+		__entry->gva = gva;
+		__entry->error_code = error_code;
+		__entry->outcome = outcome;
+	),
+
+	TP_printk("gva 0x%lx error 0x%x %s",
+		  (unsigned long)__entry->gva, __entry->error_code,
+		  __print_symbolic(__entry->outcome,
+				   { LITEVM_PF_FIXED, "fixed" },
+				   { LITEVM_PF_GUEST, "guest" },
+				   { LITEVM_PF_MMIO, "mmio" }))
+);
+
+TRACE_EVENT(litevm_emulate,
+	TP_PROTO(unsigned long rip, unsigned long cr2, int result),
+	TP_ARGS(rip, cr2, result),
+
+	TP_STRUCT__entry(
+		__field(	unsigned long,	rip		)
+		__field(	unsigned long,	cr2		)
+		__field(	int,		result		)
+	),
+
+	TP_fast_assign(
+		__entry->rip = rip;
+		__entry->cr2 = cr2;
+		__entry->result = result;
+	),
+
+	TP_printk("rip 0x%lx cr2 0x%lx %s", __entry->rip, __entry->cr2,
+		  __print_symbolic(__entry->result,
+				   { 0, "done" }, { 1, "mmio" }, { 2, "fail" }))
+);
+
+TRACE_EVENT(litevm_inj_irq,
+	TP_PROTO(int irq, int rmode),
+	TP_ARGS(irq, rmode),
+
+	TP_STRUCT__entry(
+		__field(	int,		irq		)
+		__field(	int,		rmode		)
+	),
+
+	TP_fast_assign(
+		__entry->irq = irq;
+		__entry->rmode = rmode;
+	),
+
+	TP_printk("irq 0x%x%s", __entry->irq,
+		  __entry->rmode ? " (real mode)" : "")
+);
+
+TRACE_EVENT(litevm_io,
+	TP_PROTO(int in, u16 port, int size, int string, u64 val),
+	TP_ARGS(in, port, size, string, val),
+
+	TP_STRUCT__entry(
+		__field(	int,		in		)
+		__field(	u16,		port		)
+		__field(	int,		size		)
+		__field(	int,		string		)
+		__field(	u64,		val		)
+	),
+
+	TP_fast_assign(
+		__entry->in = in;
+		__entry->port = port;
+		__entry->size = size;
+		__entry->string = string;
+		__entry->val = val;
+	),
+
+	TP_printk("%s%s port 0x%x size %d %s 0x%llx",
+		  __entry->in ? "in" : "out", __entry->string ? "s" : "",
+		  __entry->port, __entry->size,
+		  __entry->string ? "count" : "val",
+		  (unsigned long long)__entry->val)
+);
+
+TRACE_EVENT(litevm_mmio,
+	TP_PROTO(int is_write, u64 gpa, int len),
+	TP_ARGS(is_write, gpa, len),
+
+	TP_STRUCT__entry(
+		__field(	int,		is_write	)
+		__field(	u64,		gpa		)
+		__field(	int,		len		)
+	),
+
+	TP_fast_assign(
+		__entry->is_write = is_write;
+		__entry->gpa = gpa;
+		__entry->len = len;
+	),
+
+	TP_printk("%s gpa 0x%llx len %d",
+		  __entry->is_write ? "write" : "read",
+		  (unsigned long long)__entry->gpa, __entry->len)
+);
+
+#endif /* _LITEVM_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE litevm_trace
+#include <trace/define_trace.h>
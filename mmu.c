@@ -22,6 +22,7 @@
 
 #include "vmx.h"
 #include "litevm.h"
+#include "litevm_trace.h"
 
 #define pgprintk(x...) do { } while (0)
 
@@ -135,9 +136,9 @@
 #define PT_DIRECTORY_LEVEL 2
 #define PT_PAGE_TABLE_LEVEL 1
 
-static int is_write_protection(void)
+static int is_write_protection(struct litevm_vcpu *vcpu)
 {
-	return guest_cr0() & CR0_WP_MASK;
+	return guest_cr0(vcpu) & CR0_WP_MASK;
 }
 
 static int is_cpuid_PSE36(void)
@@ -311,16 +312,17 @@ static void nonpaging_flush(struct litevm_vcpu *vcpu)
 {
 	hpa_t root = vcpu->mmu.root_hpa;
 
-	++litevm_stat.tlb_flush;
+	++vcpu->stat->tlb_flush;
 	pgprintk("nonpaging_flush\n");
 	ASSERT(VALID_PAGE(root));
 	release_pt_page_64(vcpu, root, vcpu->mmu.shadow_root_level);
 	root = litevm_mmu_alloc_page(vcpu, 0);
 	ASSERT(VALID_PAGE(root));
 	vcpu->mmu.root_hpa = root;
-	if (is_paging())
+	if (is_paging(vcpu))
 		root |= (vcpu->cr3 & (CR3_PCD_MASK | CR3_WPT_MASK));
 	vmcs_writel(GUEST_CR3, root);
+	flush_guest_tlb(vcpu);
 }
 
 static gpa_t nonpaging_gva_to_gpa(struct litevm_vcpu *vcpu, gva_t vaddr)
@@ -403,7 +405,8 @@ static void litevm_mmu_flush_tlb(struct litevm_vcpu *vcpu)
 		*page->parent_pte = 0;
 		release_pt_page_64(vcpu, page->page_hpa, 1);
 	}
-	++litevm_stat.tlb_flush;
+	flush_guest_tlb_nonglobal(vcpu);
+	++vcpu->stat->tlb_flush;
 }
 
 static void paging_new_cr3(struct litevm_vcpu *vcpu)
@@ -456,12 +459,12 @@ static void inject_page_fault(struct litevm_vcpu *vcpu,
 
 	pgprintk("inject_page_fault: 0x%llx err 0x%x\n", addr, err_code);
 
-	++litevm_stat.pf_guest;
+	++vcpu->stat->pf_guest;
 
 	if (is_page_fault(vect_info)) {
 		printk(KERN_DEBUG "inject_page_fault: "
 		       "double fault 0x%llx @ 0x%lx\n",
-		       addr, vmcs_readl(GUEST_RIP));
+		       addr, vcpu_vmcs_readl(vcpu, VCPU_VMCS_RIP));
 		vmcs_write32(VM_ENTRY_EXCEPTION_ERROR_CODE, 0);
 		vmcs_write32(VM_ENTRY_INTR_INFO_FIELD,
 			     DF_VECTOR |
@@ -515,7 +518,7 @@ static void paging_inval_page(struct litevm_vcpu *vcpu, gva_t addr)
 	hpa_t page_addr = vcpu->mmu.root_hpa;
 	int level = vcpu->mmu.shadow_root_level;
 
-	++litevm_stat.invlpg;
+	++vcpu->stat->invlpg;
 
 	for (; ; level--) {
 		u32 index = PT64_INDEX(addr, level);
@@ -523,6 +526,7 @@ static void paging_inval_page(struct litevm_vcpu *vcpu, gva_t addr)
 
 		if (level == PT_PAGE_TABLE_LEVEL ) {
 			table[index] = 0;
+			flush_guest_tlb_page(vcpu, addr);
 			return;
 		}
 
@@ -536,9 +540,8 @@ static void paging_inval_page(struct litevm_vcpu *vcpu, gva_t addr)
 			table[index] = 0;
 			release_pt_page_64(vcpu, page_addr, PT_PAGE_TABLE_LEVEL);
 
-			//flush tlb
-			vmcs_writel(GUEST_CR3, vcpu->mmu.root_hpa |
-				    (vcpu->cr3 & (CR3_PCD_MASK | CR3_WPT_MASK)));
+			/* the large page was split; drop all its pieces */
+			flush_guest_tlb(vcpu);
 			return;
 		}
 	}
@@ -561,7 +564,7 @@ static int paging64_init_context(struct litevm_vcpu *vcpu)
 {
 	struct litevm_mmu *context = &vcpu->mmu;
 
-	ASSERT(is_pae());
+	ASSERT(is_pae(vcpu));
 	context->new_cr3 = paging_new_cr3;
 	context->page_fault = paging64_page_fault;
 	context->inval_page = paging_inval_page;
@@ -606,16 +609,200 @@ static int paging32E_init_context(struct litevm_vcpu *vcpu)
 	return 0;
 }
 
+/*
+ * Two dimensional paging: the cpu walks the guest's own page tables, and
+ * translates every guest physical address through an ept table that we
+ * fill on demand from the memory slots.  Guest cr3 loads, invlpg and guest
+ * page faults never leave the guest.  Ept is only used while the guest
+ * pages; real mode and unpaged protected mode stay on the nonpaging shadow
+ * context.
+ *
+ * The ept read/write/execute bits sit where PT_PRESENT_MASK,
+ * PT_WRITABLE_MASK and PT_USER_MASK are, so release_pt_page_64() and
+ * litevm_mmu_slot_remove_write_access() work on ept tables as they are.
+ */
+#define EPT_RWX_MASK \
+	(VMX_EPT_READABLE_MASK | VMX_EPT_WRITABLE_MASK | VMX_EPT_EXECUTABLE_MASK)
+
+static int ept_map(struct litevm_vcpu *vcpu, gpa_t gpa, hpa_t p)
+{
+	int level = PT64_ROOT_LEVEL;
+	hpa_t table_addr = vcpu->mmu.root_hpa;
+
+	for (; ; level--) {
+		u32 index = PT64_INDEX(gpa, level);
+		u64 *table;
+
+		ASSERT(VALID_PAGE(table_addr));
+		table = __va(table_addr);
+
+		if (level == PT_PAGE_TABLE_LEVEL) {
+			mark_page_dirty(vcpu->litevm, gpa >> PAGE_SHIFT);
+			page_header_update_slot(vcpu->litevm, table, gpa);
+			table[index] = p | EPT_RWX_MASK |
+				(VMX_EPT_MT_WB << VMX_EPT_MT_SHIFT);
+			return 0;
+		}
+
+		if (table[index] == 0) {
+			hpa_t new_table = litevm_mmu_alloc_page(vcpu,
+							     &table[index]);
+
+			if (!VALID_PAGE(new_table)) {
+				pgprintk("ept_map: ENOMEM\n");
+				return -ENOMEM;
+			}
+			table[index] = new_table | EPT_RWX_MASK;
+		}
+		table_addr = table[index] & PT64_BASE_ADDR_MASK;
+	}
+}
+
+/*
+ * Out of table pages: drop everything below the root.  The root stays, so
+ * the ept pointer in the vmcs remains valid.
+ */
+static void ept_flush(struct litevm_vcpu *vcpu)
+{
+	u64 *root = __va(vcpu->mmu.root_hpa);
+	int i;
+
+	++vcpu->stat->tlb_flush;
+	pgprintk("ept_flush\n");
+	for (i = 0; i < PT64_ENT_PER_PAGE; ++i) {
+		u64 ent = root[i];
+
+		root[i] = 0;
+		if (is_present_pte(ent))
+			release_pt_page_64(vcpu, ent & PT64_BASE_ADDR_MASK,
+					   PT64_ROOT_LEVEL - 1);
+	}
+	flush_guest_tlb(vcpu);
+}
+
+static int ept_page_fault(struct litevm_vcpu *vcpu, gva_t gpa,
+			  u32 error_code)
+{
+	ASSERT(vcpu);
+	ASSERT(VALID_PAGE(vcpu->mmu.root_hpa));
+
+	for (;;) {
+		hpa_t paddr = gpa_to_hpa(vcpu, gpa & PT64_BASE_ADDR_MASK);
+
+		if (is_error_hpa(paddr))
+			return 1;
+
+		if (!ept_map(vcpu, gpa & PAGE_MASK, paddr))
+			return 0;
+		ept_flush(vcpu);
+	}
+}
+
+/*
+ * In pae mode the cpu takes the pdptes from the vmcs at vm entry rather
+ * than from memory, so reload them whenever we load cr3 for the guest.
+ * Loads the guest does itself update the vmcs on exit.
+ */
+static void ept_load_pdptrs(struct litevm_vcpu *vcpu)
+{
+	gfn_t pdpt_gfn = vcpu->cr3 >> PAGE_SHIFT;
+	unsigned offset = (vcpu->cr3 & (PAGE_SIZE-1) & ~31) >> 3;
+	struct litevm_memory_slot *memslot;
+	u64 *pdpt;
+
+	memslot = gfn_to_memslot(vcpu->litevm, pdpt_gfn);
+	if (!memslot)
+		return;
+	pdpt = kmap_atomic(gfn_to_page(memslot, pdpt_gfn));
+	vmcs_write64(GUEST_PDPTR0, pdpt[offset]);
+	vmcs_write64(GUEST_PDPTR1, pdpt[offset + 1]);
+	vmcs_write64(GUEST_PDPTR2, pdpt[offset + 2]);
+	vmcs_write64(GUEST_PDPTR3, pdpt[offset + 3]);
+	kunmap_atomic(pdpt);
+}
+
+static void ept_load_cr3(struct litevm_vcpu *vcpu)
+{
+	vmcs_writel(GUEST_CR3, vcpu->cr3);
+	if (!is_long_mode(vcpu) && is_pae(vcpu))
+		ept_load_pdptrs(vcpu);
+}
+
+/*
+ * Only reached if the cpu insists on cr3 load exiting; the guest tables
+ * are walked by hardware either way.
+ */
+static void ept_new_cr3(struct litevm_vcpu *vcpu)
+{
+	ept_load_cr3(vcpu);
+	flush_guest_tlb_nonglobal(vcpu);
+}
+
+static void ept_inval_page(struct litevm_vcpu *vcpu, gva_t addr)
+{
+	++vcpu->stat->invlpg;
+	flush_guest_tlb_page(vcpu, addr);
+}
+
+static void ept_free(struct litevm_vcpu *vcpu)
+{
+	/* the root page may come back as someone's ept root */
+	flush_guest_tlb(vcpu);
+	nonpaging_free(vcpu);
+}
+
+/*
+ * The software walker is still needed to translate addresses for the
+ * emulator; it follows the guest's paging mode.
+ */
+static void ept_set_guest_mode(struct litevm_vcpu *vcpu)
+{
+	struct litevm_mmu *context = &vcpu->mmu;
+
+	if (is_long_mode(vcpu)) {
+		context->root_level = PT64_ROOT_LEVEL;
+		context->gva_to_gpa = paging64_gva_to_gpa;
+	} else if (is_pae(vcpu)) {
+		context->root_level = PT32E_ROOT_LEVEL;
+		context->gva_to_gpa = paging64_gva_to_gpa;
+	} else {
+		context->root_level = PT32_ROOT_LEVEL;
+		context->gva_to_gpa = paging32_gva_to_gpa;
+	}
+}
+
+static int ept_init_context(struct litevm_vcpu *vcpu)
+{
+	struct litevm_mmu *context = &vcpu->mmu;
+
+	context->new_cr3 = ept_new_cr3;
+	context->page_fault = ept_page_fault;
+	context->inval_page = ept_inval_page;
+	context->free = ept_free;
+	ept_set_guest_mode(vcpu);
+	context->shadow_root_level = PT64_ROOT_LEVEL;
+	context->root_hpa = litevm_mmu_alloc_page(vcpu, 0);
+	ASSERT(VALID_PAGE(context->root_hpa));
+	litevm_set_ept(vcpu, 1);
+	ept_load_cr3(vcpu);
+	return 0;
+}
+
 static int init_litevm_mmu(struct litevm_vcpu *vcpu)
 {
 	ASSERT(vcpu);
 	ASSERT(!VALID_PAGE(vcpu->mmu.root_hpa));
 
-	if (!is_paging())
+	if (vcpu->litevm->ept && is_paging(vcpu))
+		return ept_init_context(vcpu);
+	if (vcpu->mmu.ept)
+		litevm_set_ept(vcpu, 0);
+
+	if (!is_paging(vcpu))
 		return nonpaging_init_context(vcpu);
-	else if (is_long_mode())
+	else if (is_long_mode(vcpu))
 		return paging64_init_context(vcpu);
-	else if (is_pae())
+	else if (is_pae(vcpu))
 		return paging32E_init_context(vcpu);
 	else
 		return paging32_init_context(vcpu);
@@ -632,8 +819,28 @@ static void destroy_litevm_mmu(struct litevm_vcpu *vcpu)
 
 int litevm_mmu_reset_context(struct litevm_vcpu *vcpu)
 {
+	int r;
+
 	destroy_litevm_mmu(vcpu);
-	return init_litevm_mmu(vcpu);
+	r = init_litevm_mmu(vcpu);
+	flush_guest_tlb(vcpu);
+	return r;
+}
+
+/*
+ * The guest changed cr0, cr4 or efer.  Shadow page tables depend on the
+ * paging mode and are rebuilt; ept tables only map guest physical memory,
+ * so they survive any change that leaves the guest paging.
+ */
+int litevm_mmu_mode_changed(struct litevm_vcpu *vcpu)
+{
+	if (vcpu->mmu.ept && is_paging(vcpu)) {
+		ept_set_guest_mode(vcpu);
+		ept_load_cr3(vcpu);
+		flush_guest_tlb(vcpu);
+		return 0;
+	}
+	return litevm_mmu_reset_context(vcpu);
 }
 
 static void free_mmu_pages(struct litevm_vcpu *vcpu)
@@ -51,7 +51,7 @@ static void FNAME(init_walker)(struct guest_walker *walker,
 	hpa = safe_gpa_to_hpa(vcpu, vcpu->cr3 & PT64_BASE_ADDR_MASK);
 	walker->table = kmap_atomic(pfn_to_page(hpa >> PAGE_SHIFT));
 
-	ASSERT((!is_long_mode() && is_pae()) ||
+	ASSERT((!is_long_mode(vcpu) && is_pae(vcpu)) ||
 	       (vcpu->cr3 & ~(PAGE_MASK | CR3_FLAGS_MASK)) == 0);
 
 	walker->table = (pt_element_t *)( (unsigned long)walker->table |
@@ -114,9 +114,9 @@ static pt_element_t *FNAME(fetch_guest)(struct litevm_vcpu *vcpu,
 		    !is_present_pte(walker->table[index]) ||
 		    (walker->level == PT_DIRECTORY_LEVEL &&
 		     (walker->table[index] & PT_PAGE_SIZE_MASK) &&
-		     (PTTYPE == 64 || is_pse())))
+		     (PTTYPE == 64 || is_pse(vcpu))))
 			return &walker->table[index];
-		if (walker->level != 3 || is_long_mode())
+		if (walker->level != 3 || is_long_mode(vcpu))
 			walker->inherited_ar &= walker->table[index];
 		paddr = safe_gpa_to_hpa(vcpu, walker->table[index] & PT_BASE_ADDR_MASK);
 		kunmap_atomic(walker->table);
@@ -184,7 +184,7 @@ static u64 *FNAME(fetch)(struct litevm_vcpu *vcpu, gva_t addr,
 		shadow_addr = litevm_mmu_alloc_page(vcpu, shadow_ent);
 		if (!VALID_PAGE(shadow_addr))
 			return ERR_PTR(-ENOMEM);
-		if (!is_long_mode() && level == 3)
+		if (!is_long_mode(vcpu) && level == 3)
 			*shadow_ent = shadow_addr |
 				(*guest_ent & (PT_PRESENT_MASK | PT_PWT_MASK | PT_PCD_MASK));
 		else {
@@ -231,7 +231,7 @@ static int FNAME(fix_write_pf)(struct litevm_vcpu *vcpu,
 		 * supervisor write protection is enabled.
 		 */
 		if (!writable_shadow) {
-			if (is_write_protection())
+			if (is_write_protection(vcpu))
 				return 0;
 			*shadow_ent &= ~PT_USER_MASK;
 		}
@@ -294,6 +294,7 @@ static int FNAME(page_fault)(struct litevm_vcpu *vcpu, gva_t addr,
 	if (!shadow_pte) {
 		inject_page_fault(vcpu, addr, error_code);
 		FNAME(release_walker)(&walker);
+		trace_litevm_page_fault(addr, error_code, LITEVM_PF_GUEST);
 		return 0;
 	}
 
@@ -312,11 +313,15 @@ static int FNAME(page_fault)(struct litevm_vcpu *vcpu, gva_t addr,
 	 * mmio: emulate if accessible, otherwise its a guest fault.
 	 */
 	if (is_io_pte(*shadow_pte)) {
-		if (may_access(*shadow_pte, write_fault, user_fault))
+		if (may_access(*shadow_pte, write_fault, user_fault)) {
+			trace_litevm_page_fault(addr, error_code,
+						LITEVM_PF_MMIO);
 			return 1;
+		}
 		pgprintk("%s: io work, no access\n", __FUNCTION__);
 		inject_page_fault(vcpu, addr,
 				  error_code | PFERR_PRESENT_MASK);
+		trace_litevm_page_fault(addr, error_code, LITEVM_PF_GUEST);
 		return 0;
 	}
 
@@ -325,10 +330,12 @@ static int FNAME(page_fault)(struct litevm_vcpu *vcpu, gva_t addr,
 	 */
 	if (pte_present && !fixed) {
 		inject_page_fault(vcpu, addr, error_code);
+		trace_litevm_page_fault(addr, error_code, LITEVM_PF_GUEST);
 		return 0;
 	}
 
-	++litevm_stat.pf_fixed;
+	++vcpu->stat->pf_fixed;
+	trace_litevm_page_fault(addr, error_code, LITEVM_PF_FIXED);
 
 	return 0;
 }
@@ -349,7 +356,7 @@ static gpa_t FNAME(gva_to_gpa)(struct litevm_vcpu *vcpu, gva_t vaddr)
 
 	if (walker.level == PT_DIRECTORY_LEVEL) {
 		ASSERT((guest_pte & PT_PAGE_SIZE_MASK));
-		ASSERT(PTTYPE == 64 || is_pse());
+		ASSERT(PTTYPE == 64 || is_pse(vcpu));
 
 		gpa = (guest_pte & PT_DIR_BASE_ADDR_MASK) | (vaddr &
 			(PT_LEVEL_MASK(PT_PAGE_TABLE_LEVEL) | ~PAGE_MASK));